@@ -12,8 +12,10 @@ import urllib.request
 
 
 OSMOSIS_BINARY = "osmosis/bin/osmosis"
+EXTRACT_BINARY = "bin/extract"
 MERGED_NAME = "footways.pbf"
 MERGED_STATE_NAME = "state.txt"
+RELOAD_URL = "http://localhost:8082/admin/reload"
 
 
 class CitySpec(object):
@@ -47,6 +49,12 @@ class CitySpec(object):
     def bbox_filename(self):
         return "{}.osm.bbox.pbf".format(self.bbox_name)
 
+    def shard_state_name(self):
+        return "{}.state.txt".format(self.bbox_name)
+
+    def bbox_arg(self):
+        return "{}@{},{},{},{}".format(self.pbf_name(), self.left, self.bottom, self.right, self.top)
+
 
 CITIES = [
     CitySpec("http://download.openstreetmap.fr/extracts/russia/central_federal_district/moscow",
@@ -64,8 +72,10 @@ CITIES = [
 
 class StateDownload(object):
 
-    def __init__(self, root_dir):
+    def __init__(self, root_dir, native_extract, server_extract):
         self.root_dir = root_dir
+        self.native_extract = native_extract
+        self.server_extract = server_extract
         self.output_dir = os.path.join(root_dir, "osm_data")
         self.loaded_states = []
 
@@ -91,7 +101,8 @@ class StateDownload(object):
         logging.info("Downloading %s into %s...", link, filename)
         if not os.path.exists(self.output_dir):
             os.makedirs(self.output_dir)
-        urllib.request.urlretrieve(link, filename)
+        # the server may read the regional files by itself
+        self.replace_atomically(filename, lambda path: urllib.request.urlretrieve(link, path))
 
     def cut_bbox(self, city_spec):
         command = [
@@ -114,7 +125,10 @@ class StateDownload(object):
             return False
         self.download(city_spec.pbf_link(), city_spec.pbf_name())
         self.download(city_spec.state_link(), city_spec.state_name())
-        self.cut_bbox(city_spec)
+        if self.server_extract:
+            self.replace_shard_state(city_spec)
+        elif not self.native_extract:
+            self.cut_bbox(city_spec)
         return True
 
     def update(self):
@@ -143,25 +157,91 @@ class StateDownload(object):
         command += ["--write-pbf", merged]
         subprocess.run(command, check=True)
 
+    @staticmethod
+    def replace_atomically(destination, write):
+        """
+        The server watches its data files, so they must never be seen half-written
+        """
+        temporary = "{}.tmp".format(destination)
+        write(temporary)
+        os.replace(temporary, destination)
+
+    def write_state(self, path):
+        with open(path, "w") as out:
+            out.write("{}\n".format(int(time.time())))
+            for state in self.loaded_states:
+                out.write("{}\n".format(state))
+
     def replace_merged(self):
         source = os.path.join(self.output_dir, MERGED_NAME)
         destination = os.path.join(self.root_dir, MERGED_NAME)
         state_destination = os.path.join(self.root_dir, MERGED_STATE_NAME)
-        if os.path.exists(destination):
-            os.unlink(destination)
-        shutil.copyfile(source, destination)
-        with open(state_destination, "w") as out:
-            out.write("{}\n".format(int(time.time())))
-            for state in self.loaded_states:
+        self.replace_atomically(destination, lambda path: shutil.copyfile(source, path))
+        # the state goes last: a new state tells the server that the data is ready
+        self.replace_atomically(state_destination, self.write_state)
+        logging.info("Result: footways -> %s, state -> %s", destination, state_destination)
+
+    def replace_shard_state(self, city_spec):
+        """
+        The state of the city shard, for a server started with --shard=<bbox_name>:...
+        """
+        with open(os.path.join(self.output_dir, city_spec.state_name())) as source:
+            state = source.read()
+
+        def write_state(path):
+            with open(path, "w") as out:
+                out.write("{}\n".format(int(time.time())))
                 out.write("{}\n".format(state))
+        self.replace_atomically(os.path.join(self.root_dir, city_spec.shard_state_name()), write_state)
+
+    def replace_state(self):
+        state_destination = os.path.join(self.root_dir, MERGED_STATE_NAME)
+        self.replace_atomically(state_destination, self.write_state)
+        logging.info("Result: state -> %s", state_destination)
+
+    def extract(self):
+        """
+        Cuts and merges the cities in one pass of the native extractor
+        """
+        destination = os.path.join(self.root_dir, MERGED_NAME)
+        state_destination = os.path.join(self.root_dir, MERGED_STATE_NAME)
+        # the extractor reads the state, so it is written first but published last
+        state_temporary = "{}.tmp".format(state_destination)
+        self.write_state(state_temporary)
+
+        def write_pbf(path):
+            command = [
+                os.path.join(self.root_dir, EXTRACT_BINARY),
+                "--state={}".format(state_temporary),
+                "--pbf={}".format(path),
+            ]
+            command += [city_spec.bbox_arg() for city_spec in CITIES]
+            subprocess.run(command, check=True, cwd=self.output_dir)
+        self.replace_atomically(destination, write_pbf)
+        os.replace(state_temporary, state_destination)
         logging.info("Result: footways -> %s, state -> %s", destination, state_destination)
 
+    @staticmethod
+    def request_reload():
+        try:
+            response = requests.post(RELOAD_URL, timeout=10)
+            response.raise_for_status()
+            logging.info("Server is asked to reload")
+        except requests.RequestException as e:
+            logging.warning("Failed to ask the server to reload, it will notice the new state by itself: %s", e)
+
     def do(self):
         if not self.update():
             logging.info("Nothing was updated.")
             return
-        self.merge()
-        self.replace_merged()
+        if self.server_extract:
+            self.replace_state()
+        elif self.native_extract:
+            self.extract()
+        else:
+            self.merge()
+            self.replace_merged()
+        self.request_reload()
 
 
 def main():
@@ -171,9 +251,14 @@ def main():
     )
     parser = argparse.ArgumentParser()
     parser.add_argument("--root-dir", required=True)
+    extract = parser.add_mutually_exclusive_group()
+    extract.add_argument("--native-extract", action="store_true",
+                         help="cut footways with {} instead of osmosis".format(EXTRACT_BINARY))
+    extract.add_argument("--server-extract", action="store_true",
+                         help="only download, the server cuts footways out of the regional files, see --region")
     args = parser.parse_args()
 
-    state_download = StateDownload(args.root_dir)
+    state_download = StateDownload(args.root_dir, args.native_extract, args.server_extract)
     state_download.do()
 
     return 0
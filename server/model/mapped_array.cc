@@ -0,0 +1,41 @@
+#include "mapped_array.h"
+
+#include <atomic>
+#include <new>
+
+#include <sys/mman.h>
+
+namespace OsmModel {
+	atomic<bool> huge_pages(false);
+
+	void SetHugePages(bool enabled) {
+		huge_pages = enabled;
+	}
+
+	void* GrowMapping(void* data, size_t old_bytes, size_t new_bytes) {
+		void* result;
+		if (data) {
+			result = mremap(data, old_bytes, new_bytes, MREMAP_MAYMOVE);
+		} else {
+			result = mmap(nullptr, new_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		}
+		if (result == MAP_FAILED) {
+			throw bad_alloc();
+		}
+		if (huge_pages) {
+			madvise(result, new_bytes, MADV_HUGEPAGE);
+		}
+		return result;
+	}
+
+	void FreeMapping(void* data, size_t bytes) {
+		if (data) {
+			munmap(data, bytes);
+		}
+	}
+
+	void* MapFileRange(int fd, uint64_t offset, size_t bytes) {
+		void* result = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, off_t(offset));
+		return result == MAP_FAILED ? nullptr : result;
+	}
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+using namespace std;
+
+namespace OsmModel {
+	/* Whether mappings of arrays are backed by transparent huge pages,
+	 * for the whole process. Off by default. */
+	void SetHugePages(bool enabled);
+
+	/* Maps |new_bytes| of zeroed anonymous memory, moving the first
+	 * |old_bytes| of |data| there unless it is null. Throws bad_alloc. */
+	void* GrowMapping(void* data, size_t old_bytes, size_t new_bytes);
+
+	void FreeMapping(void* data, size_t bytes);
+
+	/* Maps |bytes| of the file |fd| from |offset| on read-only, or returns
+	 * null. The offset has to be a multiple of the page size. */
+	void* MapFileRange(int fd, uint64_t offset, size_t bytes);
+
+	/* A growable array of trivially copyable items in an anonymous memory
+	 * mapping of its own. Growing remaps the pages instead of copying them,
+	 * pages reserved but never written take no memory, and the whole array
+	 * goes back to the system at once when it is freed instead of leaving
+	 * holes in the heap. */
+	template<class T>
+	class MappedArray {
+		T* data_ = nullptr;
+		size_t size_ = 0;
+		size_t mapped_bytes_ = 0;
+		// items are served right from a read-only file mapping, see MapFile
+		bool file_backed_ = false;
+
+		void Reserve(size_t count) {
+			if (count * sizeof(T) <= mapped_bytes_) {
+				return;
+			}
+			size_t bytes = mapped_bytes_ ? 2 * mapped_bytes_ : 4096;
+			while (bytes < count * sizeof(T)) {
+				bytes *= 2;
+			}
+			if (file_backed_) {
+				// the file mapping can neither be written nor grown
+				T* data = static_cast<T*>(GrowMapping(nullptr, 0, bytes));
+				memcpy(data, data_, size_ * sizeof(T));
+				FreeMapping(data_, mapped_bytes_);
+				data_ = data;
+				file_backed_ = false;
+			} else {
+				data_ = static_cast<T*>(GrowMapping(data_, mapped_bytes_, bytes));
+			}
+			mapped_bytes_ = bytes;
+		}
+
+		void Release() {
+			FreeMapping(data_, mapped_bytes_);
+			data_ = nullptr;
+			size_ = 0;
+			mapped_bytes_ = 0;
+			file_backed_ = false;
+		}
+
+	public:
+		MappedArray() {}
+
+		MappedArray(const T* items, size_t count) {
+			Append(items, count);
+		}
+
+		~MappedArray() {
+			FreeMapping(data_, mapped_bytes_);
+		}
+
+		MappedArray(MappedArray&& other) :
+			data_(other.data_),
+			size_(other.size_),
+			mapped_bytes_(other.mapped_bytes_),
+			file_backed_(other.file_backed_)
+		{
+			other.data_ = nullptr;
+			other.size_ = 0;
+			other.mapped_bytes_ = 0;
+			other.file_backed_ = false;
+		}
+
+		MappedArray& operator=(MappedArray&& other) {
+			if (this != &other) {
+				FreeMapping(data_, mapped_bytes_);
+				data_ = other.data_;
+				size_ = other.size_;
+				mapped_bytes_ = other.mapped_bytes_;
+				file_backed_ = other.file_backed_;
+				other.data_ = nullptr;
+				other.size_ = 0;
+				other.mapped_bytes_ = 0;
+				other.file_backed_ = false;
+			}
+			return *this;
+		}
+
+		MappedArray(const MappedArray&) = delete;
+		MappedArray& operator=(const MappedArray&) = delete;
+
+		/* Replaces the items with |count| ones stored in the file |fd| from
+		 * |offset| on, which has to be a multiple of the page size. They are
+		 * read from the page cache as they are used, and take no memory of
+		 * the process. The file must not be changed in place meanwhile. */
+		bool MapFile(int fd, uint64_t offset, size_t count) {
+			Release();
+			if (count == 0) {
+				return true;
+			}
+			void* data = MapFileRange(fd, offset, count * sizeof(T));
+			if (!data) {
+				return false;
+			}
+			data_ = static_cast<T*>(data);
+			size_ = count;
+			mapped_bytes_ = count * sizeof(T);
+			file_backed_ = true;
+			return true;
+		}
+
+		void PushBack(const T& item) {
+			Reserve(size_ + 1);
+			data_[size_++] = item;
+		}
+
+		void Append(const T* items, size_t count) {
+			if (count) {
+				Reserve(size_ + count);
+				memcpy(data_ + size_, items, count * sizeof(T));
+				size_ += count;
+			}
+		}
+
+		const T* data() const {
+			return data_;
+		}
+
+		size_t size() const {
+			return size_;
+		}
+
+		size_t capacity() const {
+			return mapped_bytes_ / sizeof(T);
+		}
+
+		bool empty() const {
+			return size_ == 0;
+		}
+
+		const T& operator[](size_t i) const {
+			return data_[i];
+		}
+
+		const T& front() const {
+			return data_[0];
+		}
+
+		const T& back() const {
+			return data_[size_ - 1];
+		}
+
+		const T* begin() const {
+			return data_;
+		}
+
+		const T* end() const {
+			return data_ + size_;
+		}
+	};
+}
@@ -1,13 +1,17 @@
 #pragma once
 
-#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
 #include <string>
 #include <vector>
 
+#include "mapped_array.h"
+
 using namespace std;
 
 namespace OsmModel {
-	string JoinStrings(const vector<string>& strings, const string& delimiter) {
+	inline string JoinStrings(const vector<string>& strings, const string& delimiter) {
 		if (strings.empty()) {
 			return {};
 		}
@@ -19,119 +23,416 @@ namespace OsmModel {
 		return result;
 	}
 
+	/* Coordinates in 1e-7 degrees, which always fit in 32 bits. */
+	struct Point {
+		int32_t lat;
+		int32_t lon;
+	};
+
+	/* IDs of the key and the value in the string dictionary of the data. */
 	struct Tag {
-		const shared_ptr<string> key;
-		const shared_ptr<string> value;
+		uint32_t key;
+		uint32_t value;
 	};
 
-	class OsmObject {
-		int64_t id_;
-		vector<Tag> tags_;
+	template<class T>
+	class Range {
+		const T* begin_;
+		const T* end_;
 	public:
-		OsmObject(int64_t id, vector<Tag>&& tags) :
-			id_(id),
-			tags_(tags)
+		Range(const T* begin, const T* end) :
+			begin_(begin),
+			end_(end)
 		{}
 
-		int64_t GetId() {
-			return id_;
+		const T* begin() const {
+			return begin_;
 		}
 
-		const vector<Tag>& GetTags() const {
-			return tags_;
+		const T* end() const {
+			return end_;
 		}
 
-		string ToString(const string& prefix={}) const {
-			vector<string> result;
-			result.push_back(prefix + "{");
-			result.push_back(prefix + "  \"id\": " + to_string(id_) + ",");
-			if (!tags_.empty()) {
-				vector<string> tag_strings;
-				for (const Tag& tag : tags_) {
-					tag_strings.push_back("\"" + *tag.key + "\": \"" + *tag.value + "\"");
-				}
-				result.push_back(prefix + "  \"tags\": { " + JoinStrings(tag_strings, ", ") + " },");
+		size_t size() const {
+			return end_ - begin_;
+		}
+
+		bool empty() const {
+			return begin_ == end_;
+		}
+
+		const T& operator[](size_t i) const {
+			return begin_[i];
+		}
+	};
+
+	/* Points of a way are stored as pairs of 16-bit deltas from the
+	 * previous point. The first point, and any point too far from the
+	 * previous one, is an escape value followed by its absolute coordinates
+	 * as two 32-bit halves each. */
+	const int16_t kPointEscape = -32768;
+	const int16_t kMaxPointDelta = 32767;
+
+	/* Decodes the points of a way as it goes. */
+	class PointIterator {
+		const int16_t* data_;
+		uint32_t left_;
+		Point point_;
+
+		void Decode() {
+			if (data_[0] == kPointEscape) {
+				memcpy(&point_.lat, data_ + 1, sizeof(int32_t));
+				memcpy(&point_.lon, data_ + 3, sizeof(int32_t));
+				data_ += 5;
+			} else {
+				point_.lat += data_[0];
+				point_.lon += data_[1];
+				data_ += 2;
 			}
-			for (const string& s : DetailsToString(prefix)) {
-				result.push_back(s);
+		}
+	public:
+		typedef input_iterator_tag iterator_category;
+		typedef Point value_type;
+		typedef ptrdiff_t difference_type;
+		typedef const Point* pointer;
+		typedef const Point& reference;
+
+		PointIterator(const int16_t* data, uint32_t count) :
+			data_(data),
+			left_(count),
+			point_{0, 0}
+		{
+			if (left_) {
+				Decode();
 			}
-			result.push_back(prefix + "}");
-			return JoinStrings(result, "\n");
 		}
 
-		virtual vector<string> DetailsToString(const string& prefix) const {
-			(void) prefix;
-			return {};
+		const Point& operator*() const {
+			return point_;
+		}
+
+		const Point* operator->() const {
+			return &point_;
+		}
+
+		PointIterator& operator++() {
+			if (--left_) {
+				Decode();
+			}
+			return *this;
+		}
+
+		bool operator==(const PointIterator& other) const {
+			return left_ == other.left_;
+		}
+
+		bool operator!=(const PointIterator& other) const {
+			return left_ != other.left_;
 		}
 	};
 
-	class Node : public OsmObject {
-		int64_t lat_;
-		int64_t lon_;
+	class PointRange {
+		const int16_t* data_;
+		uint32_t count_;
 	public:
-		Node(int64_t id, vector<Tag>&& tags, int64_t lat, int64_t lon) :
-			OsmObject(id, move(tags)),
-			lat_(lat),
-			lon_(lon)
+		PointRange(const int16_t* data, uint32_t count) :
+			data_(data),
+			count_(count)
 		{}
 
-		virtual vector<string> DetailsToString(const string& prefix) const override {
-			return {
-				prefix + "  \"lat\": " + to_string(lat_),
-				prefix + "  \"lon\": " + to_string(lon_)
-			};
+		PointIterator begin() const {
+			return PointIterator(data_, count_);
+		}
+
+		PointIterator end() const {
+			return PointIterator(data_, 0);
 		}
 
-		int64_t GetLat() const {
-			return lat_;
+		size_t size() const {
+			return count_;
 		}
+	};
+
+	/* Nodes and tags of one way on its way into a store. */
+	struct WayBuffer {
+		int64_t id = 0;
+		vector<int64_t> node_ids;
+		vector<Point> points;
+		vector<Tag> tags;
 
-		int64_t GetLon() const {
-			return lon_;
+		void Clear() {
+			node_ids.clear();
+			points.clear();
+			tags.clear();
 		}
 	};
 
-	typedef shared_ptr<Node> NodeHolder;
+	class WayStore;
 
-	class Way : public OsmObject {
-		vector<NodeHolder> nodes_;
+	/* A way of a store, valid as long as the store is. */
+	class WayView {
+		friend class WayStore;
+
+		const WayStore* store_;
+		uint32_t index_;
 	public:
-		Way(int64_t id, vector<Tag>&& tags, vector<shared_ptr<Node>>&& nodes) :
-			OsmObject(id, move(tags)),
-			nodes_(nodes)
+		WayView(const WayStore* store, uint32_t index) :
+			store_(store),
+			index_(index)
 		{}
 
-		virtual vector<string> DetailsToString(const string& prefix) const override {
-			vector<string> node_strings;
-			for (const NodeHolder &node : nodes_) {
-				node_strings.push_back(node->ToString(prefix + "  "));
+		uint32_t GetIndex() const {
+			return index_;
+		}
+
+		inline int64_t GetId() const;
+		inline uint32_t CountNodes() const;
+		inline Range<int64_t> GetNodeIds() const;
+		inline PointRange GetPoints() const;
+		inline Range<Tag> GetTags() const;
+	};
+
+	/* All ways of the data as a struct of arrays. Way #i has the nodes
+	 * [node_offsets[i], node_offsets[i + 1]) of node_ids, the points encoded
+	 * in [point_offsets[i], point_offsets[i + 1]) of points, see
+	 * PointIterator, and the tags [tag_offsets[i], tag_offsets[i + 1]).
+	 * Ways are only ever appended while the data is built, and never change
+	 * once it is published. */
+	class WayStore {
+		MappedArray<int64_t> ids_;
+		MappedArray<uint32_t> node_offsets_;
+		MappedArray<int64_t> node_ids_;
+		MappedArray<uint32_t> point_offsets_;
+		MappedArray<int16_t> points_;
+		MappedArray<uint32_t> tag_offsets_;
+		MappedArray<Tag> tags_;
+
+		void EncodePoints(const Point* points, size_t count) {
+			for (size_t i = 0; i < count; ++i) {
+				int64_t lat_delta = i ? int64_t(points[i].lat) - points[i - 1].lat : 0;
+				int64_t lon_delta = i ? int64_t(points[i].lon) - points[i - 1].lon : 0;
+				if (i && -kMaxPointDelta <= lat_delta && lat_delta <= kMaxPointDelta &&
+						-kMaxPointDelta <= lon_delta && lon_delta <= kMaxPointDelta) {
+					points_.PushBack(int16_t(lat_delta));
+					points_.PushBack(int16_t(lon_delta));
+				} else {
+					int16_t escaped[5] = {kPointEscape};
+					memcpy(escaped + 1, &points[i].lat, sizeof(int32_t));
+					memcpy(escaped + 3, &points[i].lon, sizeof(int32_t));
+					points_.Append(escaped, 5);
+				}
+			}
+			point_offsets_.PushBack(uint32_t(points_.size()));
+		}
+
+		uint32_t Append(int64_t id, const int64_t* node_ids, const Point* points, size_t nodes_count, const Tag* tags, size_t tags_count) {
+			ids_.PushBack(id);
+			node_ids_.Append(node_ids, nodes_count);
+			node_offsets_.PushBack(uint32_t(node_ids_.size()));
+			EncodePoints(points, nodes_count);
+			tags_.Append(tags, tags_count);
+			tag_offsets_.PushBack(uint32_t(tags_.size()));
+			return uint32_t(ids_.size() - 1);
+		}
+
+		/* Rebuilds |items| and their |offsets| with the ranges of the ways
+		 * in |order|. */
+		template<class T>
+		static void ReorderRanges(const vector<uint32_t>& order, MappedArray<uint32_t>* offsets, MappedArray<T>* items) {
+			MappedArray<uint32_t> reordered_offsets;
+			MappedArray<T> reordered_items;
+			reordered_offsets.PushBack(0);
+			for (uint32_t index : order) {
+				reordered_items.Append(items->data() + (*offsets)[index], (*offsets)[index + 1] - (*offsets)[index]);
+				reordered_offsets.PushBack(uint32_t(reordered_items.size()));
 			}
-			return {prefix + "  \"nodes\": [",
-			        JoinStrings(node_strings, ",\n"),
-			        prefix + "  ]"};
+			*offsets = move(reordered_offsets);
+			*items = move(reordered_items);
+		}
+
+		/* True if |count| points take exactly [begin, end) of |points|. */
+		static bool PointsFit(const MappedArray<int16_t>& points, uint32_t begin, uint32_t end, uint32_t count) {
+			for (; count && begin < end; --count) {
+				begin += points[begin] == kPointEscape ? 5 : 2;
+			}
+			return count == 0 && begin == end;
+		}
+
+	public:
+		WayStore() {
+			node_offsets_.PushBack(0);
+			point_offsets_.PushBack(0);
+			tag_offsets_.PushBack(0);
 		}
 
-		vector<NodeHolder>::iterator Begin() {
-			return nodes_.begin();
+		uint32_t Size() const {
+			return uint32_t(ids_.size());
 		}
 
-		vector<NodeHolder>::iterator End() {
-			return nodes_.end();
+		WayView Get(uint32_t index) const {
+			return WayView(this, index);
 		}
 
-		vector<NodeHolder>::iterator begin() {
-			return Begin();
+		int64_t GetId(uint32_t index) const {
+			return ids_[index];
 		}
 
-		vector<NodeHolder>::iterator end() {
-			return End();
+		Range<int64_t> GetNodeIds(uint32_t index) const {
+			return Range<int64_t>(node_ids_.data() + node_offsets_[index], node_ids_.data() + node_offsets_[index + 1]);
 		}
 
-		int CountNodes() const {
-			return static_cast<int>(nodes_.size());
+		PointRange GetPoints(uint32_t index) const {
+			return PointRange(points_.data() + point_offsets_[index], node_offsets_[index + 1] - node_offsets_[index]);
+		}
+
+		Range<Tag> GetTags(uint32_t index) const {
+			return Range<Tag>(tags_.data() + tag_offsets_[index], tags_.data() + tag_offsets_[index + 1]);
+		}
+
+		uint32_t Add(const WayBuffer& way) {
+			return Append(way.id, way.node_ids.data(), way.points.data(), way.node_ids.size(), way.tags.data(), way.tags.size());
+		}
+
+		/* Tag IDs are taken as they are, the string dictionary of |way|
+		 * has to be the same or a copy. |way| may be of this very store. */
+		uint32_t Add(const WayView& way) {
+			AddRange(*way.store_, way.index_, way.index_ + 1);
+			return Size() - 1;
+		}
+
+		/* Appends ways [begin, end) of |other| in one go. */
+		void AddRange(const WayStore& other, uint32_t begin, uint32_t end) {
+			if (&other == this) {
+				// appending may move the arrays the ways are read from
+				WayStore copy;
+				copy.AddRange(other, begin, end);
+				AddRange(copy, 0, end - begin);
+				return;
+			}
+			uint32_t first_node = other.node_offsets_[begin];
+			uint32_t first_point = other.point_offsets_[begin];
+			uint32_t first_tag = other.tag_offsets_[begin];
+			uint32_t node_base = uint32_t(node_ids_.size());
+			uint32_t point_base = uint32_t(points_.size());
+			uint32_t tag_base = uint32_t(tags_.size());
+			ids_.Append(other.ids_.data() + begin, end - begin);
+			node_ids_.Append(other.node_ids_.data() + first_node, other.node_offsets_[end] - first_node);
+			// points are relative to their way only, so they copy as they are
+			points_.Append(other.points_.data() + first_point, other.point_offsets_[end] - first_point);
+			tags_.Append(other.tags_.data() + first_tag, other.tag_offsets_[end] - first_tag);
+			for (uint32_t i = begin + 1; i <= end; ++i) {
+				node_offsets_.PushBack(node_base + other.node_offsets_[i] - first_node);
+				point_offsets_.PushBack(point_base + other.point_offsets_[i] - first_point);
+				tag_offsets_.PushBack(tag_base + other.tag_offsets_[i] - first_tag);
+			}
+		}
+
+		/* Takes over arrays laid out as above, e.g. read from a snapshot.
+		 * Returns false and keeps the store empty unless they are
+		 * consistent. */
+		bool Assign(MappedArray<int64_t>&& ids, MappedArray<uint32_t>&& node_offsets, MappedArray<int64_t>&& node_ids,
+				MappedArray<uint32_t>&& point_offsets, MappedArray<int16_t>&& points, MappedArray<uint32_t>&& tag_offsets, MappedArray<Tag>&& tags) {
+			if (node_offsets.empty() || node_offsets.size() != ids.size() + 1 || point_offsets.size() != ids.size() + 1 || tag_offsets.size() != ids.size() + 1 ||
+					node_offsets.front() != 0 || node_offsets.back() != node_ids.size() ||
+					point_offsets.front() != 0 || point_offsets.back() != points.size() ||
+					tag_offsets.front() != 0 || tag_offsets.back() != tags.size()) {
+				return false;
+			}
+			for (size_t i = 1; i < node_offsets.size(); ++i) {
+				if (node_offsets[i] < node_offsets[i - 1] || point_offsets[i] < point_offsets[i - 1] || tag_offsets[i] < tag_offsets[i - 1] ||
+						!PointsFit(points, point_offsets[i - 1], point_offsets[i], node_offsets[i] - node_offsets[i - 1])) {
+					return false;
+				}
+			}
+			ids_ = move(ids);
+			node_offsets_ = move(node_offsets);
+			node_ids_ = move(node_ids);
+			point_offsets_ = move(point_offsets);
+			points_ = move(points);
+			tag_offsets_ = move(tag_offsets);
+			tags_ = move(tags);
+			return true;
+		}
+
+		/* Puts the ways in |order|, which has the old index of every way by
+		 * its new one. One array is rebuilt at a time and the old one freed
+		 * right away, so on top of the store this takes the memory of its
+		 * largest array rather than of a second store. */
+		void Reorder(const vector<uint32_t>& order) {
+			MappedArray<int64_t> ids;
+			for (uint32_t index : order) {
+				ids.PushBack(ids_[index]);
+			}
+			ids_ = move(ids);
+			ReorderRanges(order, &node_offsets_, &node_ids_);
+			ReorderRanges(order, &point_offsets_, &points_);
+			ReorderRanges(order, &tag_offsets_, &tags_);
+		}
+
+		/* Maps the string IDs of all tags through |ids|, e.g. once the
+		 * string dictionary is compacted. */
+		void RenumberStrings(const vector<uint32_t>& ids) {
+			MappedArray<Tag> tags;
+			for (const Tag& tag : tags_) {
+				tags.PushBack({ids[tag.key], ids[tag.value]});
+			}
+			tags_ = move(tags);
+		}
+
+		const MappedArray<int64_t>& GetIds() const {
+			return ids_;
+		}
+
+		const MappedArray<uint32_t>& GetNodeOffsets() const {
+			return node_offsets_;
+		}
+
+		const MappedArray<int64_t>& GetAllNodeIds() const {
+			return node_ids_;
+		}
+
+		const MappedArray<uint32_t>& GetPointOffsets() const {
+			return point_offsets_;
+		}
+
+		const MappedArray<int16_t>& GetAllPoints() const {
+			return points_;
+		}
+
+		const MappedArray<uint32_t>& GetTagOffsets() const {
+			return tag_offsets_;
+		}
+
+		const MappedArray<Tag>& GetAllTags() const {
+			return tags_;
+		}
+
+		size_t MemoryUsage() const {
+			return ids_.capacity() * sizeof(int64_t) + node_offsets_.capacity() * sizeof(uint32_t) +
+				node_ids_.capacity() * sizeof(int64_t) + point_offsets_.capacity() * sizeof(uint32_t) + points_.capacity() * sizeof(int16_t) +
+				tag_offsets_.capacity() * sizeof(uint32_t) + tags_.capacity() * sizeof(Tag);
 		}
 	};
 
-	typedef shared_ptr<Way> WayHolder;
-	typedef vector<WayHolder> WayContainer;
-}
\ No newline at end of file
+	int64_t WayView::GetId() const {
+		return store_->GetId(index_);
+	}
+
+	uint32_t WayView::CountNodes() const {
+		return uint32_t(store_->GetNodeIds(index_).size());
+	}
+
+	Range<int64_t> WayView::GetNodeIds() const {
+		return store_->GetNodeIds(index_);
+	}
+
+	PointRange WayView::GetPoints() const {
+		return store_->GetPoints(index_);
+	}
+
+	Range<Tag> WayView::GetTags() const {
+		return store_->GetTags(index_);
+	}
+
+	typedef vector<WayView> WayContainer;
+}
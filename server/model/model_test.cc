@@ -0,0 +1,139 @@
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "model.h"
+
+using namespace std;
+using namespace OsmModel;
+
+int failures = 0;
+
+void Check(bool ok, const string& what) {
+	if (!ok) {
+		cerr << "FAILED: " << what << endl;
+		++failures;
+	}
+}
+
+vector<Point> Decode(const WayStore& store, uint32_t index) {
+	vector<Point> result;
+	for (const Point& point : store.GetPoints(index)) {
+		result.push_back(point);
+	}
+	return result;
+}
+
+bool SamePoints(const vector<Point>& a, const vector<Point>& b) {
+	if (a.size() != b.size()) {
+		return false;
+	}
+	for (size_t i = 0; i < a.size(); ++i) {
+		if (a[i].lat != b[i].lat || a[i].lon != b[i].lon) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Adds a way of |points| and checks that they decode as they were and take
+ * |encoded_size| int16 values. */
+void CheckPoints(const string& what, const vector<Point>& points, size_t encoded_size) {
+	WayStore store;
+	WayBuffer way;
+	way.id = 1;
+	for (size_t i = 0; i < points.size(); ++i) {
+		way.node_ids.push_back(int64_t(i) + 1);
+	}
+	way.points = points;
+	uint32_t index = store.Add(way);
+	Check(SamePoints(Decode(store, index), points), what + " decodes");
+	Check(store.GetAllPoints().size() == encoded_size, what + " takes " + to_string(encoded_size) + " values, not " +
+		to_string(store.GetAllPoints().size()));
+}
+
+void TestEscapes() {
+	const int32_t kMax = numeric_limits<int32_t>::max();
+	const int32_t kMin = numeric_limits<int32_t>::min();
+	// the first point is always escaped, every other one is a delta unless
+	// it does not fit
+	CheckPoints("single point", {{557000000, 376000000}}, 5);
+	CheckPoints("small deltas", {{557000000, 376000000}, {557000010, 375999990}, {557000000, 376000000}}, 9);
+	CheckPoints("largest deltas", {{0, 0}, {kMaxPointDelta, -kMaxPointDelta}, {0, 0}}, 9);
+	// -32768 is the escape value itself
+	CheckPoints("delta of the escape value", {{0, 0}, {-32768, 0}, {-32768, -32768}}, 15);
+	CheckPoints("delta just too large", {{0, 0}, {0, kMaxPointDelta + 1}, {0, 1}}, 12);
+	CheckPoints("extremes", {{kMax, kMin}, {kMin, kMax}, {kMin, kMin}, {kMax, kMax}}, 20);
+	CheckPoints("mixed", {{10, 10}, {20, 20}, {100000, 20}, {100001, 21}, {0, 0}}, 5 + 2 + 5 + 2 + 5);
+}
+
+void TestAssign() {
+	WayStore store;
+	WayBuffer way;
+	way.id = 7;
+	way.node_ids = {1, 2, 3};
+	way.points = {{0, 0}, {1, 1}, {100000, 0}};
+	store.Add(way);
+	const MappedArray<int16_t>& points = store.GetAllPoints();
+
+	WayStore copy;
+	Check(copy.Assign(MappedArray<int64_t>(store.GetIds().data(), store.GetIds().size()),
+		MappedArray<uint32_t>(store.GetNodeOffsets().data(), store.GetNodeOffsets().size()),
+		MappedArray<int64_t>(store.GetAllNodeIds().data(), store.GetAllNodeIds().size()),
+		MappedArray<uint32_t>(store.GetPointOffsets().data(), store.GetPointOffsets().size()),
+		MappedArray<int16_t>(points.data(), points.size()),
+		MappedArray<uint32_t>(store.GetTagOffsets().data(), store.GetTagOffsets().size()),
+		MappedArray<Tag>()), "consistent arrays are taken");
+	Check(copy.Size() == 1 && SamePoints(Decode(copy, 0), way.points), "taken arrays decode");
+
+	// a delta where the escaped third point is makes the points fall short
+	vector<int16_t> broken(points.begin(), points.end());
+	broken[7] = 0;
+	WayStore rejected;
+	Check(!rejected.Assign(MappedArray<int64_t>(store.GetIds().data(), store.GetIds().size()),
+		MappedArray<uint32_t>(store.GetNodeOffsets().data(), store.GetNodeOffsets().size()),
+		MappedArray<int64_t>(store.GetAllNodeIds().data(), store.GetAllNodeIds().size()),
+		MappedArray<uint32_t>(store.GetPointOffsets().data(), store.GetPointOffsets().size()),
+		MappedArray<int16_t>(broken.data(), broken.size()),
+		MappedArray<uint32_t>(store.GetTagOffsets().data(), store.GetTagOffsets().size()),
+		MappedArray<Tag>()), "points that do not fit their way are rejected");
+	Check(rejected.Size() == 0, "a rejected store stays empty");
+}
+
+void TestSelfAdd() {
+	WayStore store;
+	WayBuffer way;
+	way.id = 1;
+	way.node_ids = {1, 2, 3};
+	way.points = {{0, 0}, {1, 1}, {100000, 0}};
+	way.tags = {{1, 2}};
+	store.Add(way);
+	// enough to make the arrays grow, and so move, while ways are added
+	// from the store itself
+	for (uint32_t i = 0; i < 5000; ++i) {
+		Check(store.Add(store.Get(i)) == i + 1, "a way of the store itself is added");
+	}
+	bool same = true;
+	for (uint32_t i = 0; i < store.Size(); ++i) {
+		same = same && store.GetId(i) == 1 && SamePoints(Decode(store, i), way.points) &&
+			store.GetNodeIds(i).size() == 3 && store.GetNodeIds(i)[2] == 3 &&
+			store.GetTags(i).size() == 1 && store.GetTags(i)[0].value == 2;
+	}
+	Check(same, "ways added from the store itself are copies");
+	store.AddRange(store, 0, store.Size());
+	Check(store.Size() == 10002 && SamePoints(Decode(store, 10001), way.points), "the whole store is added to itself");
+}
+
+int main() {
+	TestEscapes();
+	TestAssign();
+	TestSelfAdd();
+	if (failures) {
+		cerr << failures << " checks failed" << endl;
+		return 1;
+	}
+	cout << "OK" << endl;
+	return 0;
+}
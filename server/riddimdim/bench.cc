@@ -0,0 +1,453 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "model/model.h"
+#include "nlohmann_json/include/nlohmann/json.hpp"
+
+#include "block_decoder.h"
+#include "delta_decode.h"
+#include "grid.h"
+#include "loader.h"
+#include "node_index.h"
+#include "pbf_reader.h"
+
+using namespace std;
+using json = nlohmann::json;
+
+/* Counts heap allocations for the benchmarks to report. */
+atomic<size_t> allocations(0);
+
+/* The replacements are kept out of line, or GCC sees malloc() and free()
+ * behind them at the call sites and warns about mismatched allocations. */
+__attribute__((noinline))
+void* operator new(size_t size) {
+    ++allocations;
+    void* result = malloc(size ? size : 1);
+    if (!result) {
+        throw bad_alloc();
+    }
+    return result;
+}
+
+__attribute__((noinline))
+void operator delete(void* p) noexcept {
+    free(p);
+}
+
+// the sized form is what C++14 compilers call, it has to match
+__attribute__((noinline))
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+/* Micro benchmarks over a real PBF file, e.g.
+ *   bazel run -c opt //riddimdim:bench -- node_index /path/to/footways.pbf
+ *   bazel run -c opt //riddimdim:bench -- decode /path/to/footways.pbf
+ *   bazel run -c opt //riddimdim:bench -- decompress /path/to/footways.pbf
+ *   bazel run -c opt //riddimdim:bench -- viewports /path/to/footways.pbf /path/to/state.txt tests/load/riddimdim.ammo
+ */
+
+struct DenseNodesData {
+    vector<int64_t> ids;
+    vector<int32_t> lats;
+    vector<int32_t> lons;
+    vector<int64_t> way_refs;
+};
+
+DenseNodesData ReadNodesAndRefs(const string& data_path) {
+    DenseNodesData result;
+    FileBlockReader reader(data_path);
+    while (reader.ReadBlock()) {
+        if (reader.GetType() != kOSMData) {
+            continue;
+        }
+        const OSMPBF::PrimitiveBlock& block = reader.GetPrimitiveBlock();
+        for (int i = 0; i < block.primitivegroup_size(); ++i) {
+            const OSMPBF::PrimitiveGroup& group = block.primitivegroup(i);
+            const OSMPBF::DenseNodes& dense = group.dense();
+            int64_t id = 0, lat = 0, lon = 0;
+            for (int j = 0; j < dense.id_size(); ++j) {
+                id += dense.id(j);
+                lat += dense.lat(j);
+                lon += dense.lon(j);
+                result.ids.push_back(id);
+                result.lats.push_back(int32_t(lat));
+                result.lons.push_back(int32_t(lon));
+            }
+            for (int j = 0; j < group.ways_size(); ++j) {
+                const OSMPBF::Way& way = group.ways(j);
+                int64_t ref = 0;
+                for (int k = 0; k < way.refs_size(); ++k) {
+                    ref += way.refs(k);
+                    result.way_refs.push_back(ref);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+class Stopwatch {
+    chrono::steady_clock::time_point start_ = chrono::steady_clock::now();
+
+public:
+    double ElapsedMs() const {
+        return chrono::duration<double, milli>(chrono::steady_clock::now() - start_).count();
+    }
+};
+
+void Report(const string& name, double build_ms, double resolve_ms, double lookup_ms, size_t refs_nr, size_t found) {
+    cout << name << ": build " << build_ms << " ms, first resolve " << resolve_ms << " ms, lookup "
+         << lookup_ms * 1e6 / max<size_t>(refs_nr, 1) << " ns/ref, found " << found << endl;
+}
+
+int BenchNodeIndex(const string& data_path) {
+    DenseNodesData data = ReadNodesAndRefs(data_path);
+    cout << data.ids.size() << " nodes, " << data.way_refs.size() << " way refs" << endl;
+    {
+        // what the loader used to do: a map entry per dense node, then count + at per ref
+        Stopwatch build;
+        unordered_map<int64_t, OsmModel::Point> nodes_map;
+        for (size_t i = 0; i < data.ids.size(); ++i) {
+            nodes_map[data.ids[i]] = {data.lats[i], data.lons[i]};
+        }
+        double build_ms = build.ElapsedMs();
+        double resolve_ms[2];
+        size_t found = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            Stopwatch resolve;
+            found = 0;
+            for (int64_t ref : data.way_refs) {
+                if (nodes_map.count(ref)) {
+                    const OsmModel::Point& point = nodes_map.at(ref);
+                    found += point.lat != 0;
+                }
+            }
+            resolve_ms[pass] = resolve.ElapsedMs();
+        }
+        Report("unordered_map", build_ms, resolve_ms[0], resolve_ms[1], data.way_refs.size(), found);
+    }
+    {
+        Stopwatch build;
+        NodeIndex index;
+        index.Reserve(data.ids.size());
+        for (size_t i = 0; i < data.ids.size(); ++i) {
+            index.Insert(data.ids[i], data.lats[i], data.lons[i]);
+        }
+        double build_ms = build.ElapsedMs();
+        double resolve_ms[2];
+        size_t found = 0;
+        for (int pass = 0; pass < 2; ++pass) {
+            Stopwatch resolve;
+            found = 0;
+            for (int64_t ref : data.way_refs) {
+                const OsmModel::Point* point = index.Resolve(ref);
+                if (point) {
+                    found += point->lat != 0;
+                }
+            }
+            resolve_ms[pass] = resolve.ElapsedMs();
+        }
+        Report("NodeIndex", build_ms, resolve_ms[0], resolve_ms[1], data.way_refs.size(), found);
+    }
+    return 0;
+}
+
+/* What the loader used to do with a parsed message. */
+void CopyOut(const OSMPBF::PrimitiveBlock& message, DecodedBlock* decoded) {
+    for (const OSMPBF::PrimitiveGroup& group : message.primitivegroup()) {
+        const OSMPBF::DenseNodes& dense = group.dense();
+        size_t n = dense.id_size();
+        vector<int64_t> coordinates(n);
+        decoded->node_ids.resize(n);
+        decoded->node_lats.resize(n);
+        decoded->node_lons.resize(n);
+        DeltaDecode(dense.id().data(), n, decoded->node_ids.data());
+        DeltaDecode(dense.lat().data(), n, coordinates.data());
+        ToModelCoordinates(coordinates.data(), n, message.lat_offset(), message.granularity(), decoded->node_lats.data());
+        DeltaDecode(dense.lon().data(), n, coordinates.data());
+        ToModelCoordinates(coordinates.data(), n, message.lon_offset(), message.granularity(), decoded->node_lons.data());
+        for (const OSMPBF::Way& way : group.ways()) {
+            DecodedWay decoded_way;
+            decoded_way.id = way.id();
+            decoded_way.first_ref = uint32_t(decoded->way_refs.size());
+            decoded_way.refs_count = uint32_t(way.refs_size());
+            decoded_way.first_tag = uint32_t(decoded->way_tags.size());
+            decoded_way.tags_count = uint32_t(way.keys_size());
+            decoded->way_refs.resize(decoded_way.first_ref + decoded_way.refs_count);
+            DeltaDecode(way.refs().data(), way.refs_size(), decoded->way_refs.data() + decoded_way.first_ref);
+            for (int i = 0; i < way.keys_size(); ++i) {
+                decoded->way_tags.push_back({way.keys(i), way.vals(i)});
+            }
+            decoded->ways.push_back(decoded_way);
+        }
+    }
+}
+
+/* Runs |decode| over all blocks and reports time and heap allocations. */
+int BenchDecodeVariant(const string& name, const vector<RawBlock>& blocks, const function<bool(const RawBlock&, DecodedBlock*)>& decode) {
+    size_t allocations_before = allocations;
+    Stopwatch watch;
+    size_t nodes = 0, ways = 0;
+    for (const RawBlock& block : blocks) {
+        DecodedBlock decoded;
+        if (!decode(block, &decoded)) {
+            return 1;
+        }
+        nodes += decoded.node_ids.size();
+        ways += decoded.ways.size();
+    }
+    double elapsed_ms = watch.ElapsedMs();
+    size_t block_allocations = (allocations - allocations_before) / max<size_t>(blocks.size(), 1);
+    cout << name << ": " << elapsed_ms << " ms, " << block_allocations << " allocations/block, "
+         << nodes << " nodes, " << ways << " ways" << endl;
+    return 0;
+}
+
+int BenchDecode(const string& data_path) {
+    FileBlockReader reader(data_path);
+    vector<RawBlock> blocks;
+    RawBlock raw;
+    while (reader.ReadRawBlock(&raw)) {
+        if (raw.type == kOSMData) {
+            blocks.push_back(move(raw));
+        }
+    }
+    cout << blocks.size() << " data blocks" << endl;
+    BlobDecoder decoder;
+    OSMPBF::PrimitiveBlock heap_message;
+    int failed = 0;
+    // the copy is the same for all three, so they differ only in parsing
+    failed |= BenchDecodeVariant("Fresh heap messages", blocks, [&](const RawBlock& block, DecodedBlock* decoded) {
+        const uint8_t* data;
+        size_t size;
+        OSMPBF::PrimitiveBlock message;
+        if (!decoder.Decompress(block, &data, &size) || !message.ParseFromArray(data, size)) {
+            return false;
+        }
+        CopyOut(message, decoded);
+        return true;
+    });
+    failed |= BenchDecodeVariant("Reused heap message", blocks, [&](const RawBlock& block, DecodedBlock* decoded) {
+        const uint8_t* data;
+        size_t size;
+        if (!decoder.Decompress(block, &data, &size) || !heap_message.ParseFromArray(data, size)) {
+            return false;
+        }
+        CopyOut(heap_message, decoded);
+        return true;
+    });
+    failed |= BenchDecodeVariant("Arena messages", blocks, [&](const RawBlock& block, DecodedBlock* decoded) {
+        if (!decoder.Decode(block)) {
+            return false;
+        }
+        CopyOut(decoder.GetPrimitiveBlock(), decoded);
+        return true;
+    });
+    failed |= BenchDecodeVariant("DecodePrimitiveBlock", blocks, [&](const RawBlock& block, DecodedBlock* decoded) {
+        const uint8_t* data;
+        size_t size;
+        return decoder.Decompress(block, &data, &size) && DecodePrimitiveBlock(data, size, BlockDecodeOptions(), decoded);
+    });
+    return failed;
+}
+
+int BenchDecompress(const string& data_path) {
+    FileBlockReader reader(data_path);
+    vector<RawBlock> blocks;
+    RawBlock raw;
+    while (reader.ReadRawBlock(&raw)) {
+        blocks.push_back(move(raw));
+    }
+    BlobDecoder decoder;
+    size_t compressed = 0, decompressed = 0;
+    Stopwatch watch;
+    for (const RawBlock& block : blocks) {
+        const uint8_t* data;
+        size_t size;
+        if (!decoder.Decompress(block, &data, &size)) {
+            return 1;
+        }
+        compressed += block.size;
+        decompressed += size;
+    }
+    double elapsed_ms = watch.ElapsedMs();
+    cout << blocks.size() << " blobs, " << compressed << " -> " << decompressed << " bytes in " << elapsed_ms << " ms, "
+         << decompressed / 1e3 / max(elapsed_ms, 1e-3) << " MB/s" << endl;
+    return 0;
+}
+
+/* Counts the cache misses of the calling thread, if the kernel lets it. */
+class CacheMissCounter {
+    int fd_ = -1;
+
+public:
+    CacheMissCounter() {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    ~CacheMissCounter() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    CacheMissCounter(const CacheMissCounter&) = delete;
+    CacheMissCounter& operator=(const CacheMissCounter&) = delete;
+
+    void Start() {
+        if (fd_ >= 0) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    /* Misses since Start, or -1 if they cannot be counted. */
+    int64_t Stop() {
+        int64_t count = -1;
+        if (fd_ < 0) {
+            return count;
+        }
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(fd_, &count, sizeof(count)) != sizeof(count)) {
+            count = -1;
+        }
+        return count;
+    }
+};
+
+/* Bboxes of the /ways requests of a yandex-tank uripost ammo file. */
+bool ReadViewports(const string& ammo_path, vector<vector<Bbox<int64_t>>>* viewports) {
+    ifstream ammo(ammo_path);
+    size_t size;
+    string uri;
+    while (ammo >> size >> uri) {
+        ammo.ignore(1);
+        string body(size, '\0');
+        if (!ammo.read(&body[0], size)) {
+            break;
+        }
+        if (uri != "/ways") {
+            continue;
+        }
+        json request = json::parse(body);
+        vector<Bbox<int64_t>> bboxes;
+        for (auto& bbox : request["bboxes"]) {
+            bboxes.emplace_back(bbox["west"], bbox["south"], bbox["east"], bbox["north"]);
+        }
+        viewports->push_back(move(bboxes));
+    }
+    if (viewports->empty()) {
+        cerr << "no /ways requests in " << ammo_path << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Selects the ways of every viewport and reads them the way /ways does. */
+void BenchViewportsLayout(const string& name, const Grid<int64_t, int>& grid, const vector<vector<Bbox<int64_t>>>& viewports, int rounds) {
+    CacheMissCounter misses;
+    size_t ways = 0;
+    int64_t checksum = 0;
+    misses.Start();
+    Stopwatch watch;
+    for (int round = 0; round < rounds; ++round) {
+        for (const auto& bboxes : viewports) {
+            for (const OsmModel::WayView& way : grid.SelectWaysByBbox(bboxes)) {
+                checksum += way.GetId();
+                for (const OsmModel::Point& point : way.GetPoints()) {
+                    checksum += point.lat ^ point.lon;
+                }
+                for (const OsmModel::Tag& tag : way.GetTags()) {
+                    checksum += tag.value;
+                }
+                ++ways;
+            }
+        }
+    }
+    double elapsed_ms = watch.ElapsedMs();
+    int64_t miss_count = misses.Stop();
+    size_t queries = viewports.size() * rounds;
+    cout << name << ": " << elapsed_ms * 1e3 / queries << " us/query, " << ways / queries << " ways/query, ";
+    if (miss_count >= 0) {
+        cout << miss_count / int64_t(queries) << " cache misses/query";
+    } else {
+        cout << "cache misses not available";
+    }
+    cout << ", checksum " << checksum << endl;
+}
+
+/* Compares the Hilbert ordered ways of a load to the same ways in file
+ * order, on the viewports of the load test. */
+int BenchViewports(const string& data_path, const string& state_path, const string& ammo_path) {
+    vector<vector<Bbox<int64_t>>> viewports;
+    if (!ReadViewports(ammo_path, &viewports)) {
+        return 1;
+    }
+    OsmDataHolder osm_data = OpenPbfData2(data_path, state_path);
+    const OsmModel::WayStore& ways = osm_data->grid.GetWays();
+    // the blob records keep the ways of every blob in the order they were
+    // read, before the load sorted them
+    Grid<int64_t, int> file_order(osm_data->grid.GetCellSize());
+    for (const BlobRecord& record : osm_data->blobs) {
+        for (uint32_t way : record.ways) {
+            file_order.RestoreWay(ways.Get(way));
+        }
+    }
+    file_order.BuildCells();
+
+    const int rounds = 100;
+    BenchViewportsLayout("file order", file_order, viewports, rounds);
+    BenchViewportsLayout("hilbert order", osm_data->grid, viewports, rounds);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        cerr << "usage: " << argv[0] << " node_index|decode|decompress <file.pbf>" << endl;
+        cerr << "       " << argv[0] << " viewports <file.pbf> <state.txt> <riddimdim.ammo>" << endl;
+        return 1;
+    }
+    string mode = argv[1];
+    if (mode == "node_index") {
+        return BenchNodeIndex(argv[2]);
+    }
+    if (mode == "decode") {
+        return BenchDecode(argv[2]);
+    }
+    if (mode == "decompress") {
+        return BenchDecompress(argv[2]);
+    }
+    if (mode == "viewports") {
+        if (argc < 5) {
+            cerr << "usage: " << argv[0] << " viewports <file.pbf> <state.txt> <riddimdim.ammo>" << endl;
+            return 1;
+        }
+        return BenchViewports(argv[2], argv[3], argv[4]);
+    }
+    cerr << "unknown benchmark " << mode << endl;
+    return 1;
+}
@@ -0,0 +1,544 @@
+#include "block_decoder.h"
+
+#include <cstring>
+#include <iostream>
+
+#include "delta_decode.h"
+
+/* Field numbers and wire types below follow osmformat.proto. */
+
+const int kWireVarint = 0;
+const int kWireFixed64 = 1;
+const int kWireLengthDelimited = 2;
+const int kWireFixed32 = 5;
+
+const uint32_t kBlockStringTable = 1;
+const uint32_t kBlockPrimitiveGroup = 2;
+const uint32_t kBlockGranularity = 17;
+const uint32_t kBlockLatOffset = 19;
+const uint32_t kBlockLonOffset = 20;
+
+const uint32_t kStringTableS = 1;
+
+const uint32_t kGroupNodes = 1;
+const uint32_t kGroupDense = 2;
+const uint32_t kGroupWays = 3;
+
+const uint32_t kNodeId = 1;
+const uint32_t kNodeLat = 8;
+const uint32_t kNodeLon = 9;
+
+const uint32_t kDenseId = 1;
+const uint32_t kDenseLat = 8;
+const uint32_t kDenseLon = 9;
+
+const uint32_t kWayId = 1;
+const uint32_t kWayKeys = 2;
+const uint32_t kWayVals = 3;
+const uint32_t kWayRefs = 8;
+
+/* Cursor over a serialized message. Malformed input puts it into the failed
+ * state, after which Next returns false. */
+class WireReader {
+    const uint8_t* pos_;
+    const uint8_t* end_;
+    bool failed_ = false;
+
+public:
+    WireReader(const uint8_t* data, size_t size) : pos_(data), end_(data + size) {}
+
+    bool Failed() const {
+        return failed_;
+    }
+
+    bool Next(uint32_t* field, int* wire_type) {
+        if (failed_ || pos_ == end_) {
+            return false;
+        }
+        uint64_t tag = ReadVarint();
+        *field = uint32_t(tag >> 3);
+        *wire_type = int(tag & 7);
+        return !failed_;
+    }
+
+    uint64_t ReadVarint() {
+        uint64_t result = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos_ == end_) {
+                break;
+            }
+            uint8_t byte = *pos_++;
+            result |= uint64_t(byte & 0x7F) << shift;
+            if (byte < 0x80) {
+                return result;
+            }
+        }
+        failed_ = true;
+        return 0;
+    }
+
+    bool ReadLengthDelimited(const uint8_t** data, size_t* size) {
+        uint64_t length = ReadVarint();
+        if (failed_ || length > uint64_t(end_ - pos_)) {
+            failed_ = true;
+            return false;
+        }
+        *data = pos_;
+        *size = size_t(length);
+        pos_ += length;
+        return true;
+    }
+
+    bool Skip(int wire_type) {
+        const uint8_t* data;
+        size_t size;
+        switch (wire_type) {
+        case kWireVarint:
+            ReadVarint();
+            break;
+        case kWireFixed64:
+            SkipBytes(8);
+            break;
+        case kWireLengthDelimited:
+            ReadLengthDelimited(&data, &size);
+            break;
+        case kWireFixed32:
+            SkipBytes(4);
+            break;
+        default:
+            // groups are not used by the OSM schema
+            failed_ = true;
+        }
+        return !failed_;
+    }
+
+    void SkipBytes(size_t n) {
+        if (n > size_t(end_ - pos_)) {
+            failed_ = true;
+            return;
+        }
+        pos_ += n;
+    }
+};
+
+inline int64_t ZigZagDecode(uint64_t value) {
+    return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+/* Decodes a run of packed varints in one go. Every varint ends with the
+ * only byte of it that has the high bit clear, so counting those bytes
+ * sizes the output exactly. */
+template<class T, bool kZigZag>
+bool DecodePackedVarints(const uint8_t* data, size_t size, vector<T>* out) {
+    size_t count = 0;
+    for (size_t i = 0; i < size; ++i) {
+        count += data[i] < 0x80;
+    }
+    size_t base = out->size();
+    out->resize(base + count);
+    T* target = out->data() + base;
+    const uint8_t* pos = data;
+    const uint8_t* end = data + size;
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t value = *pos++;
+        if (value >= 0x80) {
+            value &= 0x7F;
+            int shift = 7;
+            while (true) {
+                if (pos == end || shift >= 64) {
+                    return false;
+                }
+                uint8_t byte = *pos++;
+                value |= uint64_t(byte & 0x7F) << shift;
+                if (byte < 0x80) {
+                    break;
+                }
+                shift += 7;
+            }
+        }
+        target[i] = kZigZag ? T(ZigZagDecode(value)) : T(value);
+    }
+    return pos == end;
+}
+
+/* Repeated scalars are normally packed, but a parser has to accept them one
+ * value per field as well. */
+template<class T, bool kZigZag>
+bool ReadRepeated(WireReader& reader, int wire_type, vector<T>* out) {
+    if (wire_type == kWireLengthDelimited) {
+        const uint8_t* data;
+        size_t size;
+        return reader.ReadLengthDelimited(&data, &size) && DecodePackedVarints<T, kZigZag>(data, size, out);
+    }
+    if (wire_type == kWireVarint) {
+        uint64_t value = reader.ReadVarint();
+        out->push_back(kZigZag ? T(ZigZagDecode(value)) : T(value));
+        return !reader.Failed();
+    }
+    return reader.Skip(wire_type);
+}
+
+struct Span {
+    const uint8_t* data;
+    size_t size;
+};
+
+bool SpanEquals(Span span, const string& s) {
+    return span.size == s.size() && memcmp(span.data, s.data(), s.size()) == 0;
+}
+
+/* Columns decoded before they are moved into the block. One set per
+ * thread, so that their allocations are reused from block to block. */
+struct ScratchColumns {
+    vector<int64_t> ids;
+    vector<int64_t> lats;
+    vector<int64_t> lons;
+    vector<uint32_t> keys;
+    vector<uint32_t> vals;
+};
+
+/* Block-wide parameters the groups are decoded with. */
+struct BlockContext {
+    const BlockDecodeOptions& options;
+    size_t strings_nr;
+    int32_t granularity;
+    int64_t lat_offset;
+    int64_t lon_offset;
+    ScratchColumns* scratch;
+    // by string index, bits of the way_tags entries the string is the key
+    // or the value of; null unless ways are filtered by tags
+    const vector<uint64_t>* key_masks;
+    const vector<uint64_t>* value_masks;
+};
+
+bool InBoxes(const vector<NodeBox>& boxes, int32_t lat, int32_t lon) {
+    for (const NodeBox& box : boxes) {
+        if (box.south <= lat && lat <= box.north && box.west <= lon && lon <= box.east) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Appends nodes with raw delta-decoded coordinates to the block arrays,
+ * converting and filtering them on the way. */
+void AppendNodes(const BlockContext& context, const vector<int64_t>& ids, const vector<int64_t>& lats, const vector<int64_t>& lons, DecodedBlock* result) {
+    size_t n = ids.size();
+    size_t base = result->node_ids.size();
+    result->node_ids.resize(base + n);
+    result->node_lats.resize(base + n);
+    result->node_lons.resize(base + n);
+    int64_t* out_ids = result->node_ids.data() + base;
+    int32_t* out_lats = result->node_lats.data() + base;
+    int32_t* out_lons = result->node_lons.data() + base;
+    copy(ids.begin(), ids.end(), out_ids);
+    for (size_t i = 0; i < n; ++i) {
+        result->min_node_id = min(result->min_node_id, out_ids[i]);
+        result->max_node_id = max(result->max_node_id, out_ids[i]);
+    }
+    ToModelCoordinates(lats.data(), n, context.lat_offset, context.granularity, out_lats);
+    ToModelCoordinates(lons.data(), n, context.lon_offset, context.granularity, out_lons);
+    const SortedIdSet* wanted = context.options.wanted_nodes;
+    const vector<NodeBox>* boxes = context.options.node_boxes;
+    if (boxes && boxes->empty()) {
+        boxes = nullptr;
+    }
+    if (wanted || boxes) {
+        size_t kept = 0;
+        for (size_t i = 0; i < n; ++i) {
+            if ((!wanted || wanted->Contains(out_ids[i])) && (!boxes || InBoxes(*boxes, out_lats[i], out_lons[i]))) {
+                out_ids[kept] = out_ids[i];
+                out_lats[kept] = out_lats[i];
+                out_lons[kept] = out_lons[i];
+                ++kept;
+            }
+        }
+        result->node_ids.resize(base + kept);
+        result->node_lats.resize(base + kept);
+        result->node_lons.resize(base + kept);
+    }
+}
+
+bool DecodeDenseNodes(Span dense, const BlockContext& context, DecodedBlock* result) {
+    vector<int64_t>& ids = context.scratch->ids;
+    vector<int64_t>& lats = context.scratch->lats;
+    vector<int64_t>& lons = context.scratch->lons;
+    ids.clear();
+    lats.clear();
+    lons.clear();
+    WireReader reader(dense.data, dense.size);
+    uint32_t field;
+    int wire_type;
+    while (reader.Next(&field, &wire_type)) {
+        bool ok;
+        if (field == kDenseId) {
+            ok = ReadRepeated<int64_t, true>(reader, wire_type, &ids);
+        } else if (field == kDenseLat) {
+            ok = ReadRepeated<int64_t, true>(reader, wire_type, &lats);
+        } else if (field == kDenseLon) {
+            ok = ReadRepeated<int64_t, true>(reader, wire_type, &lons);
+        } else {
+            // denseinfo and keys_vals
+            ok = reader.Skip(wire_type);
+        }
+        if (!ok) {
+            cerr << "failed to decode DenseNodes" << endl;
+            return false;
+        }
+    }
+    if (reader.Failed() || lats.size() != ids.size() || lons.size() != ids.size()) {
+        cerr << "failed to decode DenseNodes" << endl;
+        return false;
+    }
+    DeltaDecode(ids.data(), ids.size(), ids.data());
+    DeltaDecode(lats.data(), lats.size(), lats.data());
+    DeltaDecode(lons.data(), lons.size(), lons.data());
+    AppendNodes(context, ids, lats, lons, result);
+    return true;
+}
+
+bool DecodeNode(Span node, const BlockContext& context, DecodedBlock* result) {
+    vector<int64_t> id(1), lat(1), lon(1);
+    int found = 0;
+    WireReader reader(node.data, node.size);
+    uint32_t field;
+    int wire_type;
+    while (reader.Next(&field, &wire_type)) {
+        if (wire_type == kWireVarint && (field == kNodeId || field == kNodeLat || field == kNodeLon)) {
+            int64_t value = ZigZagDecode(reader.ReadVarint());
+            if (field == kNodeId) {
+                id[0] = value;
+            } else if (field == kNodeLat) {
+                lat[0] = value;
+            } else {
+                lon[0] = value;
+            }
+            found |= 1 << (field == kNodeId ? 0 : field == kNodeLat ? 1 : 2);
+        } else {
+            // tags and info
+            reader.Skip(wire_type);
+        }
+    }
+    if (reader.Failed() || found != 7) {
+        cerr << "failed to decode Node" << endl;
+        return false;
+    }
+    AppendNodes(context, id, lat, lon, result);
+    return true;
+}
+
+bool HasWantedTag(const BlockContext& context, const vector<uint32_t>& keys, const vector<uint32_t>& vals) {
+    for (size_t i = 0; i < keys.size(); ++i) {
+        if ((*context.key_masks)[keys[i]] & (*context.value_masks)[vals[i]]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DecodeWay(Span way, const BlockContext& context, DecodedBlock* result) {
+    bool refs_only = context.options.way_refs_only;
+    bool filter_tags = context.key_masks != nullptr;
+    bool read_tags = !refs_only || filter_tags;
+    DecodedWay decoded;
+    decoded.id = 0;
+    vector<uint32_t>& keys = context.scratch->keys;
+    vector<uint32_t>& vals = context.scratch->vals;
+    keys.clear();
+    vals.clear();
+    vector<int64_t>& refs = result->way_refs;
+    size_t refs_base = refs.size();
+    WireReader reader(way.data, way.size);
+    uint32_t field;
+    int wire_type;
+    while (reader.Next(&field, &wire_type)) {
+        bool ok;
+        if (field == kWayRefs) {
+            ok = ReadRepeated<int64_t, true>(reader, wire_type, &refs);
+        } else if (field == kWayKeys && read_tags) {
+            ok = ReadRepeated<uint32_t, false>(reader, wire_type, &keys);
+        } else if (field == kWayVals && read_tags) {
+            ok = ReadRepeated<uint32_t, false>(reader, wire_type, &vals);
+        } else if (refs_only) {
+            ok = reader.Skip(wire_type);
+        } else if (field == kWayId && wire_type == kWireVarint) {
+            decoded.id = int64_t(reader.ReadVarint());
+            ok = !reader.Failed();
+        } else {
+            // info and anything newer
+            ok = reader.Skip(wire_type);
+        }
+        if (!ok) {
+            cerr << "failed to decode Way" << endl;
+            return false;
+        }
+    }
+    if (reader.Failed()) {
+        cerr << "failed to decode Way" << endl;
+        return false;
+    }
+    if (read_tags) {
+        if (keys.size() != vals.size()) {
+            cerr << "keys and vals differ in size" << endl;
+            return false;
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] >= context.strings_nr || vals[i] >= context.strings_nr) {
+                cerr << "string index is out of the string table" << endl;
+                return false;
+            }
+        }
+    }
+    if (filter_tags && !HasWantedTag(context, keys, vals)) {
+        refs.resize(refs_base);
+        return true;
+    }
+    DeltaDecode(refs.data() + refs_base, refs.size() - refs_base, refs.data() + refs_base);
+    if (refs_only) {
+        return true;
+    }
+    decoded.first_ref = uint32_t(refs_base);
+    decoded.refs_count = uint32_t(refs.size() - refs_base);
+    decoded.first_tag = uint32_t(result->way_tags.size());
+    decoded.tags_count = uint32_t(keys.size());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        result->way_tags.push_back({keys[i], vals[i]});
+    }
+    result->ways.push_back(decoded);
+    return true;
+}
+
+bool DecodeGroup(Span group, const BlockContext& context, DecodedBlock* result) {
+    bool refs_only = context.options.way_refs_only;
+    WireReader reader(group.data, group.size);
+    uint32_t field;
+    int wire_type;
+    while (reader.Next(&field, &wire_type)) {
+        Span item;
+        if (wire_type != kWireLengthDelimited || (refs_only && field != kGroupWays) ||
+                (field != kGroupNodes && field != kGroupDense && field != kGroupWays)) {
+            // relations, changesets, and nodes when only refs are wanted
+            reader.Skip(wire_type);
+            continue;
+        }
+        if (!reader.ReadLengthDelimited(&item.data, &item.size)) {
+            break;
+        }
+        bool ok;
+        if (field == kGroupNodes) {
+            ok = DecodeNode(item, context, result);
+        } else if (field == kGroupDense) {
+            ok = DecodeDenseNodes(item, context, result);
+        } else {
+            ok = DecodeWay(item, context, result);
+        }
+        if (!ok) {
+            return false;
+        }
+    }
+    if (reader.Failed()) {
+        cerr << "failed to decode PrimitiveGroup" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool DecodePrimitiveBlock(const uint8_t* data, size_t size, const BlockDecodeOptions& options, DecodedBlock* result) {
+    // granularity and offsets follow the groups on the wire, so the groups
+    // are only located on this pass and decoded afterwards
+    Span stringtable = {nullptr, 0};
+    vector<Span> groups;
+    int32_t granularity = 100;
+    int64_t lat_offset = 0;
+    int64_t lon_offset = 0;
+    WireReader reader(data, size);
+    uint32_t field;
+    int wire_type;
+    while (reader.Next(&field, &wire_type)) {
+        if (wire_type == kWireLengthDelimited && (field == kBlockStringTable || field == kBlockPrimitiveGroup)) {
+            Span span;
+            if (!reader.ReadLengthDelimited(&span.data, &span.size)) {
+                break;
+            }
+            if (field == kBlockStringTable) {
+                stringtable = span;
+            } else {
+                groups.push_back(span);
+            }
+        } else if (wire_type == kWireVarint && field == kBlockGranularity) {
+            granularity = int32_t(reader.ReadVarint());
+        } else if (wire_type == kWireVarint && field == kBlockLatOffset) {
+            lat_offset = int64_t(reader.ReadVarint());
+        } else if (wire_type == kWireVarint && field == kBlockLonOffset) {
+            lon_offset = int64_t(reader.ReadVarint());
+        } else {
+            reader.Skip(wire_type);
+        }
+    }
+    if (reader.Failed()) {
+        cerr << "failed to decode PrimitiveBlock" << endl;
+        return false;
+    }
+
+    bool filter_tags = options.way_tags && !options.way_tags->empty();
+    if (filter_tags && options.way_tags->size() > 64) {
+        cerr << "too many tags to filter ways by" << endl;
+        return false;
+    }
+    vector<Span> strings;
+    if ((!options.way_refs_only || filter_tags) && stringtable.data) {
+        WireReader table_reader(stringtable.data, stringtable.size);
+        while (table_reader.Next(&field, &wire_type)) {
+            Span s;
+            if (field == kStringTableS && wire_type == kWireLengthDelimited) {
+                if (table_reader.ReadLengthDelimited(&s.data, &s.size)) {
+                    strings.push_back(s);
+                }
+            } else {
+                table_reader.Skip(wire_type);
+            }
+        }
+        if (table_reader.Failed()) {
+            cerr << "failed to decode StringTable" << endl;
+            return false;
+        }
+    }
+
+    vector<uint64_t> key_masks;
+    vector<uint64_t> value_masks;
+    if (filter_tags) {
+        key_masks.assign(strings.size(), 0);
+        value_masks.assign(strings.size(), 0);
+        for (size_t i = 0; i < strings.size(); ++i) {
+            for (size_t j = 0; j < options.way_tags->size(); ++j) {
+                const pair<string, string>& tag = (*options.way_tags)[j];
+                if (SpanEquals(strings[i], tag.first)) {
+                    key_masks[i] |= uint64_t(1) << j;
+                }
+                if (SpanEquals(strings[i], tag.second)) {
+                    value_masks[i] |= uint64_t(1) << j;
+                }
+            }
+        }
+    }
+
+    static thread_local ScratchColumns scratch;
+    BlockContext context = {options, strings.size(), granularity, lat_offset, lon_offset, &scratch,
+                            filter_tags ? &key_masks : nullptr, filter_tags ? &value_masks : nullptr};
+    for (const Span& group : groups) {
+        if (!DecodeGroup(group, context, result)) {
+            return false;
+        }
+    }
+
+    // copy out only the strings referred to by tags
+    result->strings.resize(strings.size());
+    for (const LocalTag& tag : result->way_tags) {
+        for (uint32_t index : {tag.key, tag.value}) {
+            if (result->strings[index].empty()) {
+                result->strings[index].assign((const char*) strings[index].data, strings[index].size);
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/* Sorted and deduplicated node IDs; read concurrently by the workers. */
+class SortedIdSet {
+    vector<int64_t> ids_;
+
+public:
+    void Add(const vector<int64_t>& ids) {
+        ids_.insert(ids_.end(), ids.begin(), ids.end());
+    }
+
+    void Seal() {
+        sort(ids_.begin(), ids_.end());
+        ids_.erase(unique(ids_.begin(), ids_.end()), ids_.end());
+        ids_.shrink_to_fit();
+    }
+
+    bool Contains(int64_t id) const {
+        return binary_search(ids_.begin(), ids_.end(), id);
+    }
+
+    bool ContainsAnyIn(int64_t min_id, int64_t max_id) const {
+        auto it = lower_bound(ids_.begin(), ids_.end(), min_id);
+        return it != ids_.end() && *it <= max_id;
+    }
+
+    size_t Size() const {
+        return ids_.size();
+    }
+};
+
+/* Tag as a pair of indices into the string table of its block. */
+struct LocalTag {
+    uint32_t key;
+    uint32_t value;
+};
+
+/* A way as decoded by a worker: refs are absolute, but not resolved yet,
+ * because the nodes may come from other blocks. Refs and tags are ranges of
+ * the block arrays, so that a block takes a handful of allocations however
+ * many ways it has. */
+struct DecodedWay {
+    int64_t id;
+    uint32_t first_ref;
+    uint32_t refs_count;
+    uint32_t first_tag;
+    uint32_t tags_count;
+};
+
+struct DecodedBlock {
+    bool ok = false;
+    // string table of the block, entries no tag refers to are left empty
+    vector<string> strings;
+    vector<int64_t> node_ids;
+    vector<int32_t> node_lats;
+    vector<int32_t> node_lons;
+    // IDs of all nodes of the block lie within, including the ones dropped
+    // by wanted_nodes; none if min > max
+    int64_t min_node_id = numeric_limits<int64_t>::max();
+    int64_t max_node_id = numeric_limits<int64_t>::min();
+    vector<DecodedWay> ways;
+    // refs of all ways, also filled when only way refs are collected
+    vector<int64_t> way_refs;
+    vector<LocalTag> way_tags;
+    // set by the loader for OSMData blobs, the hash is of the raw blob
+    bool data_blob = false;
+    uint64_t blob_hash = 0;
+};
+
+/* Area to keep nodes from, in 1e-7 degrees with both ends included. */
+struct NodeBox {
+    int32_t south;
+    int32_t west;
+    int32_t north;
+    int32_t east;
+};
+
+struct BlockDecodeOptions {
+    // collect refs of all ways into way_refs and skip everything else
+    bool way_refs_only = false;
+    // keep only these nodes, unless null
+    const SortedIdSet* wanted_nodes = nullptr;
+    // keep only nodes within one of these, unless null or empty
+    const vector<NodeBox>* node_boxes = nullptr;
+    // keep only ways with one of these (key, value) tags, unless null or
+    // empty, also when only refs are collected; 64 at most
+    const vector<pair<string, string>>* way_tags = nullptr;
+};
+
+/* Decodes a decompressed PrimitiveBlock straight from the wire format, without
+ * building generated messages. Fields the loader never uses (DenseInfo,
+ * Info, node tags, relations, changesets) are skipped without decoding. */
+bool DecodePrimitiveBlock(const uint8_t* data, size_t size, const BlockDecodeOptions& options, DecodedBlock* result);
@@ -0,0 +1,212 @@
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "osm_proto/osmformat.pb.h"
+
+#include "block_decoder.h"
+
+using namespace std;
+
+int failures = 0;
+
+void Check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+/* Dense nodes 10, 11 and 15, a plain node 20, ways 100 over 10, 11, 15 and
+ * 101 over 15, 20, and a relation and metadata the decoder has to skip. */
+string MakeBlock(int32_t granularity, int64_t lat_offset, int64_t lon_offset) {
+    OSMPBF::PrimitiveBlock block;
+    for (const char* s : {"", "highway", "footway", "name", "Main st", "surface", "asphalt", "unused"}) {
+        block.mutable_stringtable()->add_s(s);
+    }
+    block.set_granularity(granularity);
+    block.set_lat_offset(lat_offset);
+    block.set_lon_offset(lon_offset);
+
+    OSMPBF::DenseNodes* dense = block.add_primitivegroup()->mutable_dense();
+    int64_t last_id = 0, last_lat = 0, last_lon = 0;
+    for (int64_t id : {10, 11, 15}) {
+        int64_t lat = 557000000 + id;
+        int64_t lon = -376000000 - id;
+        dense->add_id(id - last_id);
+        dense->add_lat(lat - last_lat);
+        dense->add_lon(lon - last_lon);
+        dense->mutable_denseinfo()->add_version(1);
+        dense->add_keys_vals(7);
+        dense->add_keys_vals(7);
+        dense->add_keys_vals(0);
+        last_id = id;
+        last_lat = lat;
+        last_lon = lon;
+    }
+
+    OSMPBF::PrimitiveGroup* group = block.add_primitivegroup();
+    OSMPBF::Node* node = group->add_nodes();
+    node->set_id(20);
+    node->set_lat(557000020);
+    node->set_lon(-376000020);
+    node->add_keys(7);
+    node->add_vals(7);
+
+    group = block.add_primitivegroup();
+    OSMPBF::Way* way = group->add_ways();
+    way->set_id(100);
+    for (int64_t delta : {10, 1, 4}) {
+        way->add_refs(delta);
+    }
+    way->add_keys(1);
+    way->add_vals(2);
+    way->add_keys(3);
+    way->add_vals(4);
+    way->mutable_info()->set_version(3);
+    way = group->add_ways();
+    way->set_id(101);
+    for (int64_t delta : {15, 5}) {
+        way->add_refs(delta);
+    }
+    way->add_keys(5);
+    way->add_vals(6);
+
+    OSMPBF::Relation* relation = block.add_primitivegroup()->add_relations();
+    relation->set_id(1000);
+    relation->add_memids(100);
+    relation->add_types(OSMPBF::Relation::WAY);
+    relation->add_roles_sid(7);
+    return block.SerializeAsString();
+}
+
+bool Decode(const string& data, const BlockDecodeOptions& options, DecodedBlock* result) {
+    return DecodePrimitiveBlock(reinterpret_cast<const uint8_t*>(data.data()), data.size(), options, result);
+}
+
+vector<string> WayTags(const DecodedBlock& block, const DecodedWay& way) {
+    vector<string> result;
+    for (uint32_t i = way.first_tag; i < way.first_tag + way.tags_count; ++i) {
+        result.push_back(block.strings[block.way_tags[i].key] + "=" + block.strings[block.way_tags[i].value]);
+    }
+    return result;
+}
+
+vector<int64_t> WayRefs(const DecodedBlock& block, const DecodedWay& way) {
+    return vector<int64_t>(block.way_refs.begin() + way.first_ref, block.way_refs.begin() + way.first_ref + way.refs_count);
+}
+
+void TestFullBlock() {
+    DecodedBlock block;
+    Check(Decode(MakeBlock(100, 0, 0), BlockDecodeOptions(), &block), "full block decodes");
+    Check(block.node_ids == vector<int64_t>({10, 11, 15, 20}), "node ids");
+    Check(block.node_lats == vector<int32_t>({557000010, 557000011, 557000015, 557000020}), "node lats");
+    Check(block.node_lons == vector<int32_t>({-376000010, -376000011, -376000015, -376000020}), "node lons");
+    Check(block.min_node_id == 10 && block.max_node_id == 20, "node id range");
+    Check(block.ways.size() == 2, "ways count");
+    if (block.ways.size() == 2) {
+        Check(block.ways[0].id == 100 && block.ways[1].id == 101, "way ids");
+        Check(WayRefs(block, block.ways[0]) == vector<int64_t>({10, 11, 15}), "refs are delta decoded");
+        Check(WayRefs(block, block.ways[1]) == vector<int64_t>({15, 20}), "refs of the second way");
+        Check(WayTags(block, block.ways[0]) == vector<string>({"highway=footway", "name=Main st"}), "way tags");
+        Check(WayTags(block, block.ways[1]) == vector<string>({"surface=asphalt"}), "tags of the second way");
+    }
+    Check(block.strings.size() == 8 && block.strings[7].empty(), "strings no tag refers to are left empty");
+}
+
+void TestCoordinates() {
+    // 1000 nanodegrees per unit with offsets: (offset + 1000 * raw) / 100
+    DecodedBlock block;
+    Check(Decode(MakeBlock(1000, 500, -300), BlockDecodeOptions(), &block), "scaled block decodes");
+    if (block.node_ids.size() == 4) {
+        Check(block.node_lats[0] == int32_t((500 + 1000 * int64_t(557000010)) / 100), "scaled lat");
+        Check(block.node_lons[3] == int32_t((-300 + 1000 * int64_t(-376000020)) / 100), "scaled lon");
+    } else {
+        Check(false, "scaled block has all nodes");
+    }
+}
+
+void TestOptions() {
+    string data = MakeBlock(100, 0, 0);
+
+    BlockDecodeOptions refs_only;
+    refs_only.way_refs_only = true;
+    DecodedBlock block;
+    Check(Decode(data, refs_only, &block), "refs only decodes");
+    Check(block.way_refs == vector<int64_t>({10, 11, 15, 15, 20}), "refs only collects all refs");
+    Check(block.ways.empty() && block.node_ids.empty(), "refs only skips everything else");
+
+    vector<pair<string, string>> tags = {{"highway", "footway"}};
+    BlockDecodeOptions by_tag;
+    by_tag.way_tags = &tags;
+    block = DecodedBlock();
+    Check(Decode(data, by_tag, &block), "tag filter decodes");
+    Check(block.ways.size() == 1 && block.ways[0].id == 100, "tag filter keeps the footway only");
+    Check(block.way_refs == vector<int64_t>({10, 11, 15}), "tag filter drops the refs of other ways");
+
+    // the key alone does not do
+    tags = {{"surface", "footway"}};
+    block = DecodedBlock();
+    Check(Decode(data, by_tag, &block) && block.ways.empty(), "tag filter matches key and value together");
+
+    SortedIdSet wanted;
+    wanted.Add({11, 20});
+    wanted.Seal();
+    BlockDecodeOptions by_id;
+    by_id.wanted_nodes = &wanted;
+    block = DecodedBlock();
+    Check(Decode(data, by_id, &block), "wanted nodes decode");
+    Check(block.node_ids == vector<int64_t>({11, 20}), "only wanted nodes are kept");
+    Check(block.min_node_id == 10 && block.max_node_id == 20, "the id range covers dropped nodes too");
+
+    vector<NodeBox> boxes = {{557000011, -376000016, 557000015, -376000011}};
+    BlockDecodeOptions by_box;
+    by_box.node_boxes = &boxes;
+    block = DecodedBlock();
+    Check(Decode(data, by_box, &block), "node boxes decode");
+    Check(block.node_ids == vector<int64_t>({11, 15}), "only nodes within the box are kept");
+}
+
+void TestBrokenInput() {
+    string data = MakeBlock(100, 0, 0);
+    // no prefix may crash, and a cut within the string table always fails
+    for (size_t size = 0; size < data.size(); ++size) {
+        DecodedBlock block;
+        bool ok = Decode(data.substr(0, size), BlockDecodeOptions(), &block);
+        if (size > 0 && size < 10) {
+            Check(!ok, "cut at " + to_string(size) + " fails");
+        }
+    }
+
+    // a tag refers to a string past the table
+    OSMPBF::PrimitiveBlock block;
+    block.mutable_stringtable()->add_s("");
+    OSMPBF::Way* way = block.add_primitivegroup()->add_ways();
+    way->set_id(1);
+    way->add_refs(1);
+    way->add_keys(5);
+    way->add_vals(0);
+    DecodedBlock result;
+    Check(!Decode(block.SerializeAsString(), BlockDecodeOptions(), &result), "tag out of the string table fails");
+
+    way->clear_keys();
+    way->add_keys(0);
+    way->add_keys(0);
+    result = DecodedBlock();
+    Check(!Decode(block.SerializeAsString(), BlockDecodeOptions(), &result), "keys and vals of different sizes fail");
+}
+
+int main() {
+    TestFullBlock();
+    TestCoordinates();
+    TestOptions();
+    TestBrokenInput();
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
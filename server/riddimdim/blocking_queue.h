@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+using namespace std;
+
+/* Bounded multi-producer multi-consumer queue. Once closed, Push fails and
+ * Pop drains the remaining items before failing. */
+template<class T>
+class BlockingQueue {
+    mutex mutex_;
+    condition_variable not_empty_;
+    condition_variable not_full_;
+    deque<T> items_;
+    size_t capacity_;
+    bool closed_ = false;
+
+public:
+    explicit BlockingQueue(size_t capacity) : capacity_(capacity) {}
+
+    bool Push(T&& item) {
+        unique_lock<mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_) {
+            return false;
+        }
+        items_.push_back(move(item));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool Pop(T* item) {
+        unique_lock<mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty()) {
+            return false;
+        }
+        *item = move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void Close() {
+        lock_guard<mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+};
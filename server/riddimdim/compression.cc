@@ -0,0 +1,135 @@
+#include "compression.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <lz4.h>
+#include <zlib.h>
+#include <zstd.h>
+
+string CompressionName(Compression compression) {
+    switch (compression) {
+    case Compression::kRaw:
+        return "raw";
+    case Compression::kZlib:
+        return "zlib";
+    case Compression::kLz4:
+        return "lz4";
+    case Compression::kZstd:
+        return "zstd";
+    }
+    return "unknown";
+}
+
+bool ParseCompression(const string& name, Compression* compression) {
+    for (Compression candidate : {Compression::kRaw, Compression::kZlib, Compression::kLz4, Compression::kZstd}) {
+        if (CompressionName(candidate) == name) {
+            *compression = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+int64_t Inflate(const uint8_t* data, size_t size, size_t raw_size, vector<uint8_t>* buffer) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit(&stream) != Z_OK) {
+        cerr << "failed to init zlib" << endl;
+        return -1;
+    }
+    stream.next_in = const_cast<Bytef*>(data);
+    stream.avail_in = uInt(size);
+    // without raw_size start from a guess and double it until it fits
+    size_t capacity = raw_size ? raw_size : 4 * size + 1024;
+    int status;
+    while (true) {
+        if (buffer->size() < capacity) {
+            buffer->resize(capacity);
+        }
+        stream.next_out = buffer->data() + stream.total_out;
+        stream.avail_out = uInt(capacity - stream.total_out);
+        status = inflate(&stream, Z_FINISH);
+        bool out_of_space = stream.avail_out == 0 && (status == Z_OK || status == Z_BUF_ERROR);
+        if (status == Z_STREAM_END || !out_of_space || raw_size) {
+            break;
+        }
+        capacity *= 2;
+    }
+    int64_t result = int64_t(stream.total_out);
+    inflateEnd(&stream);
+    if (status != Z_STREAM_END || (raw_size && size_t(result) != raw_size)) {
+        cerr << "failed to inflate zlib data" << endl;
+        return -1;
+    }
+    return result;
+}
+
+int64_t Decompress(Compression compression, const uint8_t* data, size_t size, size_t raw_size, vector<uint8_t>* buffer) {
+    if (compression == Compression::kRaw) {
+        if (buffer->size() < size) {
+            buffer->resize(size);
+        }
+        memcpy(buffer->data(), data, size);
+        return int64_t(size);
+    }
+    if (compression == Compression::kZlib) {
+        return Inflate(data, size, raw_size, buffer);
+    }
+    if (!raw_size) {
+        cerr << "raw_size is required for " << CompressionName(compression) << " data" << endl;
+        return -1;
+    }
+    if (buffer->size() < raw_size) {
+        buffer->resize(raw_size);
+    }
+    if (compression == Compression::kLz4) {
+        int written = LZ4_decompress_safe((const char*) data, (char*) buffer->data(), int(size), int(raw_size));
+        if (written < 0 || size_t(written) != raw_size) {
+            cerr << "failed to decompress lz4 data" << endl;
+            return -1;
+        }
+        return written;
+    }
+    size_t written = ZSTD_decompress(buffer->data(), raw_size, data, size);
+    if (ZSTD_isError(written) || written != raw_size) {
+        cerr << "failed to decompress zstd data" << endl;
+        return -1;
+    }
+    return int64_t(written);
+}
+
+bool Compress(Compression compression, const uint8_t* data, size_t size, string* out) {
+    if (compression == Compression::kRaw) {
+        out->assign((const char*) data, size);
+        return true;
+    }
+    if (compression == Compression::kZlib) {
+        uLongf written = compressBound(uLong(size));
+        out->resize(written);
+        if (compress2((Bytef*) &(*out)[0], &written, data, uLong(size), Z_BEST_COMPRESSION) != Z_OK) {
+            cerr << "failed to compress zlib data" << endl;
+            return false;
+        }
+        out->resize(written);
+        return true;
+    }
+    if (compression == Compression::kLz4) {
+        out->resize(LZ4_compressBound(int(size)));
+        int written = LZ4_compress_default((const char*) data, &(*out)[0], int(size), int(out->size()));
+        if (written <= 0) {
+            cerr << "failed to compress lz4 data" << endl;
+            return false;
+        }
+        out->resize(written);
+        return true;
+    }
+    out->resize(ZSTD_compressBound(size));
+    size_t written = ZSTD_compress(&(*out)[0], out->size(), data, size, 19);
+    if (ZSTD_isError(written)) {
+        cerr << "failed to compress zstd data" << endl;
+        return false;
+    }
+    out->resize(written);
+    return true;
+}
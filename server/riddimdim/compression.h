@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Payload encodings of a Blob, after its fields in fileformat.proto. */
+enum class Compression {
+    kRaw,
+    kZlib,
+    kLz4,
+    kZstd,
+};
+
+string CompressionName(Compression compression);
+
+/* The inverse of CompressionName, returns false for an unknown name. */
+bool ParseCompression(const string& name, Compression* compression);
+
+/* Decompresses |size| bytes of |data| into |buffer|. |raw_size| is the size
+ * stated by the Blob; with it the output is written in one go into a buffer
+ * of exactly that size. lz4 and zstd need it, zlib can do without. The
+ * buffer never shrinks, so that it can be reused from blob to blob.
+ * Returns the decompressed size or -1. */
+int64_t Decompress(Compression compression, const uint8_t* data, size_t size, size_t raw_size, vector<uint8_t>* buffer);
+
+/* Compresses |size| bytes of |data| into |out| for a Blob, zlib and zstd at
+ * near their highest levels, as files are written once and read many times.
+ * Returns false on failure. */
+bool Compress(Compression compression, const uint8_t* data, size_t size, string* out);
@@ -0,0 +1,97 @@
+#include "delta_decode.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+const int64_t kNanodegreesPerUnit = 100;
+
+void DeltaDecodeScalar(const int64_t* in, size_t n, int64_t* out) {
+    // unsigned, so that it wraps around like the SIMD versions
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) {
+        sum += uint64_t(in[i]);
+        out[i] = int64_t(sum);
+    }
+}
+
+#if defined(__x86_64__)
+
+void DeltaDecodeSse2(const int64_t* in, size_t n, int64_t* out) {
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2) {
+        __m128i x = _mm_loadu_si128((const __m128i*) (in + i));
+        // [x0, x0 + x1]
+        x = _mm_add_epi64(x, _mm_slli_si128(x, 8));
+        x = _mm_add_epi64(x, carry);
+        _mm_storeu_si128((__m128i*) (out + i), x);
+        // broadcast the last sum
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 2, 3, 2));
+    }
+    uint64_t sum = i ? uint64_t(out[i - 1]) : 0;
+    for (; i < n; ++i) {
+        sum += uint64_t(in[i]);
+        out[i] = int64_t(sum);
+    }
+}
+
+__attribute__((target("avx2")))
+void DeltaDecodeAvx2(const int64_t* in, size_t n, int64_t* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i carry = zero;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256i x = _mm256_loadu_si256((const __m256i*) (in + i));
+        // [x0, x0 + x1, x2, x2 + x3]: the byte shift stays within 128-bit lanes
+        x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+        // add x0 + x1 to the upper lane
+        __m256i low_sum = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 1, 1, 1));
+        x = _mm256_add_epi64(x, _mm256_blend_epi32(zero, low_sum, 0xF0));
+        x = _mm256_add_epi64(x, carry);
+        _mm256_storeu_si256((__m256i*) (out + i), x);
+        carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    uint64_t sum = i ? uint64_t(out[i - 1]) : 0;
+    for (; i < n; ++i) {
+        sum += uint64_t(in[i]);
+        out[i] = int64_t(sum);
+    }
+}
+
+typedef void (*DeltaDecodeFunction)(const int64_t*, size_t, int64_t*);
+
+DeltaDecodeFunction SelectDeltaDecode() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return DeltaDecodeAvx2;
+    }
+    return DeltaDecodeSse2;
+}
+
+void DeltaDecode(const int64_t* in, size_t n, int64_t* out) {
+    static const DeltaDecodeFunction implementation = SelectDeltaDecode();
+    implementation(in, n, out);
+}
+
+#else
+
+void DeltaDecode(const int64_t* in, size_t n, int64_t* out) {
+    DeltaDecodeScalar(in, n, out);
+}
+
+#endif
+
+void ToModelCoordinates(const int64_t* in, size_t n, int64_t offset, int32_t granularity, int32_t* out) {
+    if (granularity == kNanodegreesPerUnit && offset % kNanodegreesPerUnit == 0) {
+        // the usual case: the values are model units already, this loop vectorizes
+        int64_t shift = offset / kNanodegreesPerUnit;
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = int32_t(in[i] + shift);
+        }
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        out[i] = int32_t((offset + granularity * in[i]) / kNanodegreesPerUnit);
+    }
+}
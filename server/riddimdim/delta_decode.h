@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+/* Turns delta coded values into absolute ones: out[i] = in[0] + ... + in[i].
+ * Uses AVX2 or SSE2 prefix sums when the CPU has them. |in| and |out| may
+ * be the same array. */
+void DeltaDecode(const int64_t* in, size_t n, int64_t* out);
+
+/* The implementations DeltaDecode picks from, for tests. All of them wrap
+ * around on overflow. */
+void DeltaDecodeScalar(const int64_t* in, size_t n, int64_t* out);
+#if defined(__x86_64__)
+void DeltaDecodeSse2(const int64_t* in, size_t n, int64_t* out);
+// only where the CPU has AVX2
+void DeltaDecodeAvx2(const int64_t* in, size_t n, int64_t* out);
+#endif
+
+/* Converts raw PBF coordinates, which are in |granularity| nanodegrees
+ * relative to |offset| nanodegrees, into the 1e-7 degree units of the
+ * model. */
+void ToModelCoordinates(const int64_t* in, size_t n, int64_t offset, int32_t granularity, int32_t* out);
@@ -0,0 +1,96 @@
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "delta_decode.h"
+
+using namespace std;
+
+typedef void (*DeltaDecodeFunction)(const int64_t*, size_t, int64_t*);
+
+int failures = 0;
+
+void Check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+vector<int64_t> Expected(const vector<int64_t>& in) {
+    vector<int64_t> result;
+    uint64_t sum = 0;
+    for (int64_t value : in) {
+        sum += uint64_t(value);
+        result.push_back(int64_t(sum));
+    }
+    return result;
+}
+
+/* Runs |decode| on |in| both into another array and in place, starting
+ * at every offset of a longer array, so that the SIMD loads are unaligned
+ * too. */
+void CheckDecode(DeltaDecodeFunction decode, const string& name, const vector<int64_t>& in) {
+    vector<int64_t> expected = Expected(in);
+    for (size_t shift = 0; shift < 4; ++shift) {
+        vector<int64_t> buffer(shift + in.size() + 1, 42);
+        vector<int64_t> out(buffer.size(), 42);
+        copy(in.begin(), in.end(), buffer.begin() + shift);
+        decode(buffer.data() + shift, in.size(), out.data() + shift);
+        string what = name + " of " + to_string(in.size()) + " at " + to_string(shift);
+        Check(vector<int64_t>(out.begin() + shift, out.end() - 1) == expected, what);
+        Check(out.back() == 42 && (shift == 0 || out[shift - 1] == 42), what + " stays within the output");
+        decode(buffer.data() + shift, in.size(), buffer.data() + shift);
+        Check(vector<int64_t>(buffer.begin() + shift, buffer.end() - 1) == expected, what + " in place");
+    }
+}
+
+int main() {
+    vector<pair<DeltaDecodeFunction, string>> functions = {
+        {DeltaDecode, "DeltaDecode"},
+        {DeltaDecodeScalar, "DeltaDecodeScalar"},
+    };
+#if defined(__x86_64__)
+    functions.push_back({DeltaDecodeSse2, "DeltaDecodeSse2"});
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        functions.push_back({DeltaDecodeAvx2, "DeltaDecodeAvx2"});
+    } else {
+        cout << "no AVX2, skipping DeltaDecodeAvx2" << endl;
+    }
+#endif
+
+    mt19937_64 random(1);
+    uniform_int_distribution<int64_t> small(-1000, 1000);
+    uniform_int_distribution<int64_t> any(numeric_limits<int64_t>::min(), numeric_limits<int64_t>::max());
+    for (const auto& function : functions) {
+        // every tail length after the 2- and 4-wide loops
+        for (size_t n = 0; n <= 50; ++n) {
+            vector<int64_t> deltas(n);
+            for (int64_t& delta : deltas) {
+                delta = small(random);
+            }
+            CheckDecode(function.first, function.second, deltas);
+            // sums run over and under int64 and have to wrap around
+            for (int64_t& delta : deltas) {
+                delta = any(random);
+            }
+            CheckDecode(function.first, function.second + " wrapping", deltas);
+        }
+        const int64_t max = numeric_limits<int64_t>::max();
+        const int64_t min = numeric_limits<int64_t>::min();
+        CheckDecode(function.first, function.second + " over max", {max, 1, 1, 1, 1, 1, 1});
+        CheckDecode(function.first, function.second + " under min", {min, -1, -1, -1, -1});
+        CheckDecode(function.first, function.second + " extremes", {max, max, min, min, max, 0, min, -1, 1});
+    }
+
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
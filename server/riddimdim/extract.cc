@@ -0,0 +1,88 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "grid.h"
+#include "loader.h"
+#include "pbf_writer.h"
+#include "snapshot.h"
+
+using namespace std;
+
+/* Cuts footways out of regional extracts and merges them into a PBF file
+ * for the server, or a snapshot it loads as is, instead of osmosis --tf
+ * --used-node --bounding-box and --merge. */
+
+bool StartsWith(const char* s, const char* prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+int main(int argc, char** argv) {
+    string state_path;
+    string snapshot_path;
+    string pbf_path;
+    PbfWriteOptions write_options;
+    vector<pair<string, string>> tags = kFootwayTags;
+    LoadOptions options;
+    vector<string> input_args;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (StartsWith(arg, "--state=")) {
+            state_path = arg + strlen("--state=");
+        } else if (StartsWith(arg, "--snapshot=")) {
+            snapshot_path = arg + strlen("--snapshot=");
+        } else if (StartsWith(arg, "--pbf=")) {
+            pbf_path = arg + strlen("--pbf=");
+        } else if (StartsWith(arg, "--compression=")) {
+            if (!ParseCompression(arg + strlen("--compression="), &write_options.compression)) {
+                cerr << "bad compression: " << arg << endl;
+                return 1;
+            }
+        } else if (StartsWith(arg, "--tags=")) {
+            if (!ParseTagList(arg + strlen("--tags="), &tags)) {
+                cerr << "bad tags: " << arg << endl;
+                return 1;
+            }
+        } else if (StartsWith(arg, "--threads=")) {
+            options.threads = atoi(arg + strlen("--threads="));
+        } else if (arg[0] != '-') {
+            input_args.push_back(arg);
+        } else {
+            input_args.clear();
+            break;
+        }
+    }
+    if (state_path.empty() || (snapshot_path.empty() && pbf_path.empty()) || input_args.empty()) {
+        cerr << "usage: " << argv[0] << " --state=state.txt [--pbf=footways.pbf] [--snapshot=footways.snapshot]"
+             << " [--compression=zlib|zstd|lz4|raw] [--tags=highway=footway,highway=cycleway] [--threads=N]"
+             << " region.osm.pbf[@WEST,SOUTH,EAST,NORTH]..." << endl;
+        return 1;
+    }
+
+    vector<PbfInput> inputs;
+    for (const string& arg : input_args) {
+        PbfInput input;
+        if (!ParsePbfInput(arg, &input)) {
+            cerr << "bad input: " << arg << endl;
+            return 1;
+        }
+        input.filter.tags = tags;
+        inputs.push_back(input);
+    }
+    OsmDataHolder osm_data = OpenPbfInputs(inputs, state_path, options);
+    if (!osm_data->complete) {
+        cerr << "failed to read all of the input" << endl;
+        return 1;
+    }
+    if (!pbf_path.empty() && !WritePbfFile(*osm_data, pbf_path, write_options)) {
+        return 1;
+    }
+    // the snapshot stands in for the PBF file the server is started with
+    uint64_t source = SnapshotSource(pbf_path.empty() ? "footways.pbf" : pbf_path);
+    if (!snapshot_path.empty() && !WriteSnapshot(*osm_data, snapshot_path, source)) {
+        return 1;
+    }
+    return 0;
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <limits>
 #include <set>
 #include <map>
+#include <vector>
 #include "model/model.h"
 
 using namespace std;
@@ -25,62 +28,277 @@ struct Bbox {
     }
 };
 
+/* Position of (x, y) along the Hilbert curve that fills the whole 2^32 by
+ * 2^32 square. Points close on the curve are close on the plane too. */
+inline uint64_t HilbertIndex(uint32_t x, uint32_t y) {
+    uint64_t index = 0;
+    for (uint32_t s = 1u << 31; s; s >>= 1) {
+        uint32_t rx = (x & s) ? 1 : 0;
+        uint32_t ry = (y & s) ? 1 : 0;
+        index += uint64_t(s) * s * ((3 * rx) ^ ry);
+        // turn the quadrant so that the curve enters it the usual way
+        if (!ry) {
+            if (rx) {
+                x = ~x;
+                y = ~y;
+            }
+            swap(x, y);
+        }
+    }
+    return index;
+}
+
 template<class T, class U>
 class Grid {
+public:
     typedef pair<U, U> GridKey;
+    // cells list ways by their index in the store
+    typedef vector<uint32_t> Cell;
+    // marks ways of a previous grid that were not taken over, see RestoreCells
+    static constexpr uint32_t kMissingWay = numeric_limits<uint32_t>::max();
 
+private:
     T cell_size_;
-    OsmModel::WayContainer way_container_;
-    map<GridKey, OsmModel::WayContainer> grid_;
+    OsmModel::WayStore ways_;
+    map<GridKey, Cell> grid_;
+    // bounds of the keys of all cells, none while min > max
+    GridKey min_key_ = {numeric_limits<U>::max(), numeric_limits<U>::max()};
+    GridKey max_key_ = {numeric_limits<U>::min(), numeric_limits<U>::min()};
+
+    void CoverKey(const GridKey& key) {
+        min_key_.first = min(min_key_.first, key.first);
+        min_key_.second = min(min_key_.second, key.second);
+        max_key_.first = max(max_key_.first, key.first);
+        max_key_.second = max(max_key_.second, key.second);
+    }
 
     GridKey GetGridKey(const T& lat, const T& lon) const {
         return GridKey(U(lat / cell_size_), U(lon / cell_size_));
     }
 
-    GridKey GetGridKey(const OsmModel::NodeHolder &node) const {
-        return GetGridKey(node->GetLat(), node->GetLon());
+    set<GridKey> GetWayKeys(uint32_t index) const {
+        set<GridKey> keys;
+        for (const OsmModel::Point& point : ways_.GetPoints(index)) {
+            keys.insert(GetGridKey(point.lat, point.lon));
+        }
+        return keys;
     }
 
 public:
     explicit Grid(T cell_size) : cell_size_(cell_size) {}
 
-    void AddWay(const OsmModel::WayHolder& way) {
-        way_container_.push_back(way);
-        set<GridKey> keys;
-        for (auto it = way->Begin(); it != way->End(); ++it) {
-            const OsmModel::NodeHolder& node = *it;
-            GridKey key = GetGridKey(node);
-            keys.insert(key);
-        }
-        for (const GridKey& key : keys) {
-            grid_[key].push_back(way);
+    /* Takes a WayBuffer or a WayView. */
+    template<class W>
+    void AddWay(const W& way) {
+        uint32_t index = ways_.Add(way);
+        for (const GridKey& key : GetWayKeys(index)) {
+            grid_[key].push_back(index);
+            CoverKey(key);
         }
     }
 
     OsmModel::WayContainer SelectWaysByBbox(const vector<Bbox<T>>& bboxes) const {
-        set<OsmModel::WayHolder> collector;
+        vector<uint32_t> collector;
         for (const Bbox<T>& bbox : bboxes) {
+            // no need to look up cells outside the bounds
             GridKey start = GetGridKey(bbox.south_, bbox.west_);
             GridKey end = GetGridKey(bbox.north_, bbox.east_);
+            start = {max(start.first, min_key_.first), max(start.second, min_key_.second)};
+            end = {min(end.first, max_key_.first), min(end.second, max_key_.second)};
             GridKey cur;
             for (cur.first = start.first; cur.first <= end.first; ++cur.first) {
                 for (cur.second = start.second; cur.second <= end.second; ++cur.second) {
-                    if (!grid_.count(cur)) continue;
-                    const OsmModel::WayContainer& cell_ways = grid_.at(cur);
-                    for (const OsmModel::WayHolder& way : cell_ways) {
-                        collector.insert(way);
-                    }
+                    auto it = grid_.find(cur);
+                    if (it == grid_.end()) continue;
+                    collector.insert(collector.end(), it->second.begin(), it->second.end());
                 }
             }
         }
+        sort(collector.begin(), collector.end());
+        collector.erase(unique(collector.begin(), collector.end()), collector.end());
         OsmModel::WayContainer result;
-        for (const OsmModel::WayHolder& way : collector) {
-            result.push_back(way);
+        result.reserve(collector.size());
+        for (uint32_t index : collector) {
+            result.push_back(ways_.Get(index));
         }
         return result;
     }
 
+    /* True if some cell may have ways within |bbox|. */
+    bool Intersects(const Bbox<T>& bbox) const {
+        GridKey start = GetGridKey(bbox.south_, bbox.west_);
+        GridKey end = GetGridKey(bbox.north_, bbox.east_);
+        return start.first <= max_key_.first && min_key_.first <= end.first &&
+            start.second <= max_key_.second && min_key_.second <= end.second;
+    }
+
     int CountWays() const {
-        return int(way_container_.size());
+        return int(ways_.Size());
+    }
+
+    T GetCellSize() const {
+        return cell_size_;
+    }
+
+    const OsmModel::WayStore& GetWays() const {
+        return ways_;
+    }
+
+    const map<GridKey, Cell>& GetCells() const {
+        return grid_;
+    }
+
+    /* RestoreWay(s) and RestoreCell put back the state built by AddWay,
+     * e.g. from a snapshot, without recomputing the cells of every way. */
+    template<class W>
+    uint32_t RestoreWay(const W& way) {
+        return ways_.Add(way);
+    }
+
+    void RestoreWays(OsmModel::WayStore&& ways) {
+        ways_ = move(ways);
+    }
+
+    /* Appends ways [begin, end) of |ways| in one go, returns the index of
+     * the first one. */
+    uint32_t RestoreWayRange(const OsmModel::WayStore& ways, uint32_t begin, uint32_t end) {
+        uint32_t first = ways_.Size();
+        ways_.AddRange(ways, begin, end);
+        return first;
+    }
+
+    void RenumberStrings(const vector<uint32_t>& ids) {
+        ways_.RenumberStrings(ids);
+    }
+
+    /* Position of a way of |points| in the order of SortWays: the Hilbert
+     * index of its centroid. Takes a PointRange or a vector of points. */
+    template<class P>
+    static uint64_t GetWayOrder(const P& points) {
+        int64_t lat = 0;
+        int64_t lon = 0;
+        for (const OsmModel::Point& point : points) {
+            lat += point.lat;
+            lon += point.lon;
+        }
+        int64_t count = max<int64_t>(1, points.size());
+        // signed coordinates are flipped into unsigned order
+        return HilbertIndex(uint32_t(int32_t(lon / count)) ^ 0x80000000u, uint32_t(int32_t(lat / count)) ^ 0x80000000u);
+    }
+
+    /* Orders the ways put in with RestoreWay by the Hilbert index of their
+     * centroid, so that the ways a bbox selects lie close together in
+     * memory. Has to come before their cells are built. Returns the new
+     * index of every way by its old one. */
+    vector<uint32_t> SortWays() {
+        vector<pair<uint64_t, uint32_t>> keys;
+        keys.reserve(ways_.Size());
+        for (uint32_t i = 0; i < ways_.Size(); ++i) {
+            keys.push_back({GetWayOrder(ways_.GetPoints(i)), i});
+        }
+        sort(keys.begin(), keys.end());
+        vector<uint32_t> order(keys.size());
+        vector<uint32_t> moved(keys.size());
+        for (uint32_t i = 0; i < keys.size(); ++i) {
+            order[i] = keys[i].second;
+            moved[keys[i].second] = i;
+        }
+        keys.clear();
+        keys.shrink_to_fit();
+        ways_.Reorder(order);
+        return moved;
+    }
+
+    /* Maps way indices through the result of SortWays, leaving kMissingWay
+     * alone. */
+    static void RenumberWays(const vector<uint32_t>& moved, vector<uint32_t>* indices) {
+        for (uint32_t& index : *indices) {
+            if (index != kMissingWay) {
+                index = moved[index];
+            }
+        }
+    }
+
+    void RestoreCell(const GridKey& key, Cell&& ways) {
+        grid_[key] = move(ways);
+        CoverKey(key);
     }
-};
\ No newline at end of file
+
+    /* Builds the cells of all ways put in with RestoreWay, same as AddWay
+     * would. |taken_over| has an entry for every way of |previous|: its
+     * index here if it was taken over with the same nodes, kMissingWay
+     * otherwise. Such ways keep the cells they have there, only the others
+     * have theirs computed. */
+    void RestoreCells(const Grid& previous, const vector<uint32_t>& taken_over) {
+        // index of every way listed in the cells of |previous| in this grid
+        vector<uint32_t> previous_indices;
+        vector<bool> placed(ways_.Size(), false);
+        for (const auto& cell : previous.grid_) {
+            for (uint32_t way : cell.second) {
+                uint32_t index = taken_over[way];
+                previous_indices.push_back(index);
+                if (index != kMissingWay) {
+                    placed[index] = true;
+                }
+            }
+        }
+        vector<pair<GridKey, uint32_t>> computed;
+        for (uint32_t i = 0; i < ways_.Size(); ++i) {
+            if (!placed[i]) {
+                for (const GridKey& key : GetWayKeys(i)) {
+                    computed.push_back({key, i});
+                }
+            }
+        }
+        sort(computed.begin(), computed.end());
+
+        // both are ordered by key, so cells are merged and appended in order
+        auto next = computed.begin();
+        Cell cell_indices;
+        auto take_computed = [&](const GridKey& key) {
+            for (; next != computed.end() && next->first == key; ++next) {
+                cell_indices.push_back(next->second);
+            }
+        };
+        auto add_cell = [&](const GridKey& key) {
+            if (cell_indices.empty()) {
+                return;
+            }
+            // cells list their ways in the order they were added
+            if (!is_sorted(cell_indices.begin(), cell_indices.end())) {
+                sort(cell_indices.begin(), cell_indices.end());
+            }
+            grid_.emplace_hint(grid_.end(), key, move(cell_indices));
+            CoverKey(key);
+            cell_indices.clear();
+        };
+        size_t offset = 0;
+        for (const auto& cell : previous.grid_) {
+            while (next != computed.end() && next->first < cell.first) {
+                GridKey key = next->first;
+                take_computed(key);
+                add_cell(key);
+            }
+            for (size_t i = 0; i < cell.second.size(); ++i, ++offset) {
+                if (previous_indices[offset] != kMissingWay) {
+                    cell_indices.push_back(previous_indices[offset]);
+                }
+            }
+            take_computed(cell.first);
+            add_cell(cell.first);
+        }
+        while (next != computed.end()) {
+            GridKey key = next->first;
+            take_computed(key);
+            add_cell(key);
+        }
+    }
+
+    /* Builds the cells of all ways put in with RestoreWay from scratch. */
+    void BuildCells() {
+        RestoreCells(Grid(cell_size_), {});
+    }
+};
+
+template<class T, class U>
+constexpr uint32_t Grid<T, U>::kMissingWay;
@@ -0,0 +1,936 @@
+#include "loader.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <sys/stat.h>
+
+#include "block_decoder.h"
+#include "blocking_queue.h"
+#include "node_index.h"
+#include "pbf_reader.h"
+
+const vector<pair<string, string>> kFootwayTags = {{"highway", "footway"}, {"highway", "cycleway"}};
+
+bool StartsWith(const string& s, const string& prefix) {
+    size_t n = prefix.size();
+    if (s.size() < n)
+        return false;
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] != prefix[i])
+            return false;
+    }
+    return true;
+}
+
+bool ParseTagList(const string& s, vector<pair<string, string>>* tags) {
+    tags->clear();
+    size_t begin = 0;
+    while (begin < s.size()) {
+        size_t end = s.find(',', begin);
+        if (end == string::npos) {
+            end = s.size();
+        }
+        string tag = s.substr(begin, end - begin);
+        size_t equals = tag.find('=');
+        if (equals == string::npos || equals == 0) {
+            return false;
+        }
+        tags->emplace_back(tag.substr(0, equals), tag.substr(equals + 1));
+        begin = end + 1;
+    }
+    return true;
+}
+
+bool ParsePbfInput(const string& s, PbfInput* input) {
+    size_t at = s.rfind('@');
+    input->path = s.substr(0, at);
+    input->filter.bboxes.clear();
+    if (at == string::npos) {
+        return true;
+    }
+    double west, south, east, north;
+    if (sscanf(s.c_str() + at + 1, "%lf,%lf,%lf,%lf", &west, &south, &east, &north) != 4) {
+        return false;
+    }
+    input->filter.bboxes.push_back({int64_t(west * 1e7), int64_t(south * 1e7), int64_t(east * 1e7), int64_t(north * 1e7)});
+    return true;
+}
+
+/* Hands decoded blocks to the merge stage in file order. Workers may run at
+ * most |window| blocks ahead of the merge, which bounds memory usage. */
+class ReorderBuffer {
+    mutex mutex_;
+    condition_variable changed_;
+    map<int64_t, DecodedBlock> ready_;
+    int64_t next_ = 0;
+    int64_t total_ = -1;
+    int64_t window_;
+    bool cancelled_ = false;
+
+public:
+    explicit ReorderBuffer(int64_t window) : window_(window) {}
+
+    bool Put(int64_t index, DecodedBlock&& block) {
+        unique_lock<mutex> lock(mutex_);
+        changed_.wait(lock, [&] { return cancelled_ || index < next_ + window_; });
+        if (cancelled_) {
+            return false;
+        }
+        ready_.emplace(index, move(block));
+        changed_.notify_all();
+        return true;
+    }
+
+    bool Take(DecodedBlock* block) {
+        unique_lock<mutex> lock(mutex_);
+        changed_.wait(lock, [&] {
+            return cancelled_ || ready_.count(next_) || (total_ >= 0 && next_ >= total_);
+        });
+        auto it = ready_.find(next_);
+        if (cancelled_ || it == ready_.end()) {
+            return false;
+        }
+        *block = move(it->second);
+        ready_.erase(it);
+        ++next_;
+        changed_.notify_all();
+        return true;
+    }
+
+    void Finish(int64_t total) {
+        lock_guard<mutex> lock(mutex_);
+        total_ = total;
+        changed_.notify_all();
+    }
+
+    void Cancel() {
+        lock_guard<mutex> lock(mutex_);
+        cancelled_ = true;
+        changed_.notify_all();
+    }
+};
+
+/* Maps block-local string indices to global dictionary IDs on first use,
+ * so that strings no tag refers to (user names and such) are never
+ * interned. */
+class BlockStringResolver {
+    const vector<string>& table_;
+    StringDictionary& dictionary_;
+    vector<int64_t> ids_;
+
+public:
+    BlockStringResolver(const vector<string>& table, StringDictionary& dictionary) :
+        table_(table),
+        dictionary_(dictionary),
+        ids_(table.size(), -1)
+    {}
+
+    uint32_t Resolve(uint32_t index) {
+        if (ids_[index] < 0) {
+            ids_[index] = dictionary_.Intern(table_[index]);
+        }
+        return uint32_t(ids_[index]);
+    }
+};
+
+void CollectTags(const LocalTag* local_tags, size_t n, BlockStringResolver& resolver, vector<OsmModel::Tag>* result) {
+    for (size_t i = 0; i < n; ++i) {
+        const LocalTag& tag = local_tags[i];
+        result->push_back({resolver.Resolve(tag.key), resolver.Resolve(tag.value)});
+    }
+}
+
+/* Fills |result| with the way, returns false if none of its nodes is known. */
+bool ReadWay(const DecodedBlock& block, const DecodedWay& way, NodeIndex& nodes, BlockStringResolver& resolver, OsmModel::WayBuffer* result, bool *broken, vector<int64_t>* missing_refs) {
+    result->Clear();
+    result->id = way.id;
+    *broken = false;
+    bool started = false;
+    const int64_t* refs = block.way_refs.data() + way.first_ref;
+    for (uint32_t i = 0; i < way.refs_count; ++i) {
+        int64_t ref = refs[i];
+        const OsmModel::Point* point = nodes.Resolve(ref);
+        if (!point) {
+            *broken = true;
+            missing_refs->push_back(ref);
+            // cerr << "Not found node #" << ref << " for way #" << way.id << ", skipping the way entirely"<< endl;
+            if (started) {
+                break;
+            } else {
+                continue;
+            }
+        }
+        started = true;
+        result->node_ids.push_back(ref);
+        result->points.push_back(*point);
+    }
+    if (result->node_ids.empty()) {
+        return false;
+    }
+    CollectTags(block.way_tags.data() + way.first_tag, way.tags_count, resolver, &result->tags);
+    return true;
+}
+
+/* Not cryptographic, just enough to tell changed blobs apart. */
+uint64_t HashBytes(const uint8_t* data, size_t size) {
+    const uint64_t kMultiplier = 0x9E3779B97F4A7C15ull;
+    uint64_t hash = uint64_t(size) * kMultiplier;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * kMultiplier;
+        hash ^= hash >> 29;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    hash = (hash ^ tail) * kMultiplier;
+    return hash ^ (hash >> 32);
+}
+
+bool DecodeBlock(BlobDecoder& decoder, const RawBlock& raw, const BlockDecodeOptions& options, DecodedBlock* result) {
+    if (raw.type != kOSMData) {
+        return decoder.Decode(raw);
+    }
+    result->data_blob = true;
+    result->blob_hash = HashBytes(raw.Data(), raw.size);
+    const uint8_t* data;
+    size_t size;
+    if (!decoder.Decompress(raw, &data, &size)) {
+        return false;
+    }
+    return DecodePrimitiveBlock(data, size, options, result);
+}
+
+void InsertNodes(const DecodedBlock& block, NodeIndex& nodes) {
+    for (size_t i = 0; i < block.node_ids.size(); ++i) {
+        nodes.Insert(block.node_ids[i], block.node_lats[i], block.node_lons[i]);
+    }
+}
+
+/* Resolves the ways of a data block, adds them to the grid and records
+ * what the blob contributed. The cells are left until the ways are
+ * sorted, see SortWays. */
+void MergeWays(const DecodedBlock& block, NodeIndex& nodes, OsmData* osm_data) {
+    if (!block.data_blob) {
+        return;
+    }
+    BlobRecord record;
+    record.hash = block.blob_hash;
+    record.min_node_id = block.min_node_id;
+    record.max_node_id = block.max_node_id;
+    BlockStringResolver resolver(block.strings, osm_data->strings);
+    OsmModel::WayBuffer way;
+    for (const DecodedWay& decoded_way : block.ways) {
+        bool broken = false;
+        if (!ReadWay(block, decoded_way, nodes, resolver, &way, &broken, &record.missing_refs)) {
+            ++record.skipped_ways;
+            continue;
+        }
+        if (broken) {
+            ++record.partial_ways;
+        }
+        record.ways.push_back(osm_data->grid.RestoreWay(way));
+    }
+    osm_data->skipped_ways += record.skipped_ways;
+    osm_data->partial_ways += record.partial_ways;
+    osm_data->blobs.push_back(move(record));
+}
+
+/* Orders the ways along the Hilbert curve before their cells are built,
+ * renumbering the blob records and |taken_over|, unless null, to match. */
+void SortWays(OsmData* osm_data, vector<uint32_t>* taken_over) {
+    vector<uint32_t> moved = osm_data->grid.SortWays();
+    for (BlobRecord& record : osm_data->blobs) {
+        Grid<int64_t, int>::RenumberWays(moved, &record.ways);
+    }
+    if (taken_over) {
+        Grid<int64_t, int>::RenumberWays(moved, taken_over);
+    }
+}
+
+void CompactStrings(OsmData* osm_data) {
+    const StringDictionary& strings = osm_data->strings;
+    const uint32_t kUnused = numeric_limits<uint32_t>::max();
+    // the known keys come first in any dictionary
+    StringDictionary compacted;
+    vector<uint32_t> ids(strings.Size(), kUnused);
+    for (uint32_t key = 0; key < kTagKeyCount; ++key) {
+        ids[key] = key;
+    }
+    for (const OsmModel::Tag& tag : osm_data->grid.GetWays().GetAllTags()) {
+        if (ids[tag.key] == kUnused) {
+            ids[tag.key] = compacted.Intern(strings.Get(tag.key));
+        }
+        if (ids[tag.value] == kUnused) {
+            ids[tag.value] = compacted.Intern(strings.Get(tag.value));
+        }
+    }
+    if (compacted.Size() == strings.Size()) {
+        return;
+    }
+    osm_data->grid.RenumberStrings(ids);
+    osm_data->strings = move(compacted);
+}
+
+/* Takes over the ways of an unchanged blob from |previous|, noting their
+ * new indices in |taken_over|. Their cells are left to Grid::RestoreCells.
+ * The strings of |osm_data| have to start as a copy of those of |previous|. */
+void ReuseBlob(const OsmData& previous, const BlobRecord& record, OsmData* osm_data, vector<uint32_t>* taken_over) {
+    BlobRecord reused = record;
+    const OsmModel::WayStore& ways = previous.grid.GetWays();
+    for (uint32_t& way : reused.ways) {
+        uint32_t index = osm_data->grid.RestoreWay(ways.Get(way));
+        (*taken_over)[way] = index;
+        way = index;
+    }
+    osm_data->skipped_ways += record.skipped_ways;
+    osm_data->partial_ways += record.partial_ways;
+    osm_data->blobs.push_back(move(reused));
+}
+
+int64_t ReadState(const string& state_path, string* timestamp, int64_t* sequence) {
+    ifstream state_reader(state_path);
+    if (!state_reader) {
+        cerr << "failed to open state file " << state_path << endl;
+        return 0;
+    }
+    int64_t result = 0;
+    // the state is a Unix time, anything before 2001 is not one
+    if (!(state_reader >> result) || result < 1000000000) {
+        cerr << "no valid state in " << state_path << endl;
+        return 0;
+    }
+    if (timestamp || sequence) {
+        string line;
+        const static string kTimestampPrefix = "timestamp=";
+        const static string kSequencePrefix = "sequenceNumber=";
+        // a merged file holds the states of every city one after another
+        string oldest;
+        int sequences = 0;
+        int64_t last_sequence = 0;
+        while (state_reader >> line) {
+            if (StartsWith(line, kTimestampPrefix)) {
+                string t = line.substr(kTimestampPrefix.size());
+                string t2;
+                for (char c : t) {
+                    if (c == '\\') continue;
+                    t2.push_back(c);
+                }
+                if (oldest.empty() || t2 < oldest) {
+                    oldest = t2;
+                }
+            } else if (StartsWith(line, kSequencePrefix)) {
+                last_sequence = strtoll(line.c_str() + kSequencePrefix.size(), nullptr, 10);
+                ++sequences;
+            }
+        }
+        if (timestamp && !oldest.empty()) {
+            *timestamp = oldest;
+        }
+        // the diffs of one city do not apply to the others
+        if (sequence && sequences == 1) {
+            *sequence = last_sequence;
+        }
+    }
+    return result;
+}
+
+int64_t FileSize(const string& path) {
+    struct stat file_stat;
+    return stat(path.c_str(), &file_stat) == 0 ? int64_t(file_stat.st_size) : 0;
+}
+
+typedef function<bool(BlobDecoder&, const RawBlock&, DecodedBlock*)> BlockDecodeFunction;
+typedef function<void(DecodedBlock&)> BlockMergeFunction;
+
+/* Stops the pipeline of ProcessBlocks and joins its threads however the
+ * function is left. An exception from the merge stage would otherwise
+ * unwind past joinable threads and terminate the process. */
+class PipelineJoiner {
+    BlockingQueue<RawBlock>& raw_blocks_;
+    ReorderBuffer& decoded_blocks_;
+    vector<thread>& threads_;
+
+public:
+    PipelineJoiner(BlockingQueue<RawBlock>& raw_blocks, ReorderBuffer& decoded_blocks, vector<thread>& threads) :
+        raw_blocks_(raw_blocks),
+        decoded_blocks_(decoded_blocks),
+        threads_(threads)
+    {}
+
+    ~PipelineJoiner() {
+        Join();
+    }
+
+    void Join() {
+        decoded_blocks_.Cancel();
+        raw_blocks_.Close();
+        for (thread& t : threads_) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+    }
+};
+
+/* Runs the reader thread, |threads| decoding workers and the merge stage on
+ * the calling thread. The reader keeps to max_read_bytes_per_second if it
+ * is positive and counts what it reads into the progress, if any. Returns
+ * true if the whole file was read and decoded. An exception thrown by any
+ * stage stops the others and is rethrown once all threads are joined. */
+bool ProcessBlocks(const string& data_path, int threads, const LoadOptions& options, const BlockDecodeFunction& decode, const BlockMergeFunction& merge) {
+    FileBlockReader reader(data_path);
+    BlockingQueue<RawBlock> raw_blocks(2 * threads);
+    ReorderBuffer decoded_blocks(4 * threads);
+    vector<thread> pipeline;
+    PipelineJoiner joiner(raw_blocks, decoded_blocks, pipeline);
+
+    // the first exception of the reader or a worker
+    exception_ptr failure;
+    mutex failure_mutex;
+    auto fail = [&](exception_ptr error) {
+        {
+            lock_guard<mutex> lock(failure_mutex);
+            if (!failure) {
+                failure = error;
+            }
+        }
+        decoded_blocks.Cancel();
+        raw_blocks.Close();
+    };
+
+    bool reached_end = false;
+    pipeline.emplace_back([&]() {
+        try {
+            int64_t count = 0;
+            int64_t bytes = 0;
+            auto start_time = chrono::steady_clock::now();
+            RawBlock raw;
+            while (reader.ReadRawBlock(&raw)) {
+                bytes += raw.size;
+                if (options.progress) {
+                    options.progress->bytes_read += raw.size;
+                }
+                if (!raw_blocks.Push(move(raw))) {
+                    break;
+                }
+                ++count;
+                if (options.max_read_bytes_per_second > 0) {
+                    // sleep off whatever is read ahead of the allowed pace
+                    auto due_time = start_time + chrono::microseconds(bytes * 1000000 / options.max_read_bytes_per_second);
+                    this_thread::sleep_until(due_time);
+                }
+            }
+            reached_end = reader.ReachedEnd();
+            raw_blocks.Close();
+            decoded_blocks.Finish(count);
+        } catch (...) {
+            fail(current_exception());
+        }
+    });
+
+    for (int i = 0; i < threads; ++i) {
+        pipeline.emplace_back([&]() {
+            try {
+                BlobDecoder decoder;
+                RawBlock raw;
+                while (raw_blocks.Pop(&raw)) {
+                    DecodedBlock decoded;
+                    decoded.ok = decode(decoder, raw, &decoded);
+                    if (!decoded_blocks.Put(raw.index, move(decoded))) {
+                        break;
+                    }
+                }
+            } catch (...) {
+                fail(current_exception());
+            }
+        });
+    }
+
+    DecodedBlock block;
+    bool decoded_all = true;
+    while (decoded_blocks.Take(&block)) {
+        if (!block.ok) {
+            // same as a failed read: everything before the broken block is kept
+            decoded_all = false;
+            break;
+        }
+        merge(block);
+    }
+    joiner.Join();
+    if (failure) {
+        rethrow_exception(failure);
+    }
+    return decoded_all && reached_end;
+}
+
+/* Counts for the load report. */
+struct FileLoadStats {
+    size_t referenced_nodes = 0;
+    size_t nodes = 0;
+};
+
+/* True if the index bbox of a data blob shows that none of its nodes is
+ * within |boxes|, so neither are the ways of the blob. */
+bool BlockOutsideBoxes(const RawBlock& raw, const vector<NodeBox>& boxes) {
+    OSMPBF::HeaderBBox bbox;
+    if (boxes.empty() || raw.type != kOSMData || !ParseBlockBbox(raw, &bbox)) {
+        return false;
+    }
+    // the index is in nanodegrees
+    for (const NodeBox& box : boxes) {
+        if (bbox.bottom() <= box.north * 100LL && box.south * 100LL <= bbox.top() &&
+                bbox.left() <= box.east * 100LL && box.west * 100LL <= bbox.right()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Reads one file into |osm_data|, keeping only what |filter| lets through.
+ * With referenced_nodes_only the refs of the wanted ways are collected on a
+ * first pass, so that the second one keeps only the nodes they need. Blobs
+ * outside the bboxes by their index are not even inflated, their ways are
+ * not counted as skipped. Returns true if the whole file was read and
+ * decoded. */
+bool LoadPbfFile(const string& data_path, const WayFilter& filter, const LoadOptions& options, int threads,
+                 OsmData* osm_data, FileLoadStats* stats) {
+    vector<NodeBox> boxes;
+    for (const Bbox<int64_t>& bbox : filter.bboxes) {
+        boxes.push_back({int32_t(bbox.south_), int32_t(bbox.west_), int32_t(bbox.north_), int32_t(bbox.east_)});
+    }
+    if (options.progress) {
+        options.progress->bytes_total += FileSize(data_path) * (options.referenced_nodes_only ? 2 : 1);
+    }
+    SortedIdSet referenced_nodes;
+    bool complete = true;
+    if (options.referenced_nodes_only) {
+        BlockDecodeOptions refs_options;
+        refs_options.way_refs_only = true;
+        refs_options.way_tags = &filter.tags;
+        complete = ProcessBlocks(data_path, threads, options, [&](BlobDecoder& decoder, const RawBlock& raw, DecodedBlock* result) {
+            if (BlockOutsideBoxes(raw, boxes)) {
+                return true;
+            }
+            return DecodeBlock(decoder, raw, refs_options, result);
+        }, [&](DecodedBlock& block) {
+            referenced_nodes.Add(block.way_refs);
+        });
+        referenced_nodes.Seal();
+    }
+    BlockDecodeOptions decode_options;
+    decode_options.wanted_nodes = options.referenced_nodes_only ? &referenced_nodes : nullptr;
+    decode_options.node_boxes = &boxes;
+    decode_options.way_tags = &filter.tags;
+
+    // lives only until every way is resolved and put into the grid
+    NodeIndex nodes;
+    nodes.Reserve(referenced_nodes.Size());
+    if (complete) {
+        complete = ProcessBlocks(data_path, threads, options, [&](BlobDecoder& decoder, const RawBlock& raw, DecodedBlock* result) {
+            if (BlockOutsideBoxes(raw, boxes)) {
+                return true;
+            }
+            return DecodeBlock(decoder, raw, decode_options, result);
+        }, [&](DecodedBlock& block) {
+            InsertNodes(block, nodes);
+            MergeWays(block, nodes, osm_data);
+        });
+    }
+    SortWays(osm_data, nullptr);
+    osm_data->grid.BuildCells();
+    stats->referenced_nodes += referenced_nodes.Size();
+    stats->nodes += nodes.Size();
+    return complete;
+}
+
+void PrintLoadReport(const OsmData& osm_data, const LoadOptions& options, const FileLoadStats& stats,
+                     chrono::steady_clock::time_point start_time, int threads) {
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "State " << osm_data.state << ":" << endl;
+    cout << "  Total number of strings: " << osm_data.strings.Size() << endl;
+    if (options.referenced_nodes_only) {
+        cout << "  Number of node IDs referenced by ways: " << stats.referenced_nodes << endl;
+    }
+    cout << "  Total number of nodes: " << stats.nodes << endl;
+    cout << "  Total number of ways: " << osm_data.grid.CountWays() << endl;
+    cout << "  Number of skipped ways: " << osm_data.skipped_ways << endl;
+    cout << "  Number of partial ways: " << osm_data.partial_ways << endl;
+    cout << "  Loaded in " << elapsed.count() << " ms by " << threads << " decoding thread(s)" << endl;
+}
+
+OsmDataHolder OpenPbfData2(const string& data_path, const string& state_path, const LoadOptions& options) {
+    cout << "Loading data from " << data_path << " and " << state_path << endl;
+    int threads = options.threads;
+    if (threads <= 0) {
+        threads = max(1, int(thread::hardware_concurrency()));
+    }
+    auto start_time = chrono::steady_clock::now();
+    OsmDataHolder osm_data = make_shared<OsmData>(1e4);
+    osm_data->state = ReadState(state_path, &(osm_data->timestamp), &(osm_data->sequence));
+    if (!osm_data->timestamp.empty()) {
+        cout << "Timestamp: " << osm_data->timestamp << endl;
+    }
+    FileLoadStats stats;
+    osm_data->complete = LoadPbfFile(data_path, WayFilter(), options, threads, osm_data.get(), &stats);
+    PrintLoadReport(*osm_data, options, stats, start_time, threads);
+    return osm_data;
+}
+
+OsmDataHolder OpenPbfInputs(const vector<PbfInput>& inputs, const string& state_path, const LoadOptions& options) {
+    cout << "Loading data from " << inputs.size() << " file(s) and " << state_path << endl;
+    int threads = options.threads;
+    if (threads <= 0) {
+        threads = max(1, int(thread::hardware_concurrency()));
+    }
+    auto start_time = chrono::steady_clock::now();
+    OsmDataHolder osm_data = make_shared<OsmData>(1e4);
+    osm_data->state = ReadState(state_path, &(osm_data->timestamp), &(osm_data->sequence));
+    if (!osm_data->timestamp.empty()) {
+        cout << "Timestamp: " << osm_data->timestamp << endl;
+    }
+    // every file is loaded on its own, the decoding threads are split
+    // between them
+    size_t count = inputs.size();
+    int file_threads = max(1, threads / max(1, int(count)));
+    vector<unique_ptr<OsmData>> parts;
+    vector<FileLoadStats> part_stats(count);
+    vector<char> part_complete(count, false);
+    // a failed file is rethrown once every loader is joined
+    vector<exception_ptr> part_failures(count);
+    vector<thread> loaders;
+    for (size_t i = 0; i < count; ++i) {
+        cout << "Reading " << inputs[i].path << endl;
+        parts.emplace_back(new OsmData(1e4));
+        loaders.emplace_back([&, i]() {
+            try {
+                part_complete[i] = LoadPbfFile(inputs[i].path, inputs[i].filter, options, file_threads, parts[i].get(), &part_stats[i]);
+            } catch (...) {
+                part_failures[i] = current_exception();
+            }
+        });
+    }
+    for (thread& loader : loaders) {
+        loader.join();
+    }
+    for (const exception_ptr& failure : part_failures) {
+        if (failure) {
+            rethrow_exception(failure);
+        }
+    }
+
+    // extracts of neighbouring regions overlap, a way is taken from the
+    // first file that has it
+    unordered_set<int64_t> seen_ways;
+    FileLoadStats stats;
+    bool complete = true;
+    size_t largest = 0;
+    // indices of the ways of every file in the merged data
+    vector<vector<uint32_t>> taken_over(count);
+    OsmModel::WayBuffer buffer;
+    for (size_t i = 0; i < count; ++i) {
+        const OsmData& part = *parts[i];
+        complete = complete && part_complete[i];
+        stats.referenced_nodes += part_stats[i].referenced_nodes;
+        stats.nodes += part_stats[i].nodes;
+        osm_data->skipped_ways += part.skipped_ways;
+        osm_data->partial_ways += part.partial_ways;
+        // string IDs of the file in the merged dictionary, on first use
+        vector<int64_t> string_ids(part.strings.Size(), -1);
+        auto string_id = [&](uint32_t id) {
+            if (string_ids[id] < 0) {
+                string_ids[id] = osm_data->strings.Intern(*part.strings.Get(id));
+            }
+            return uint32_t(string_ids[id]);
+        };
+        const OsmModel::WayStore& ways = part.grid.GetWays();
+        taken_over[i].assign(ways.Size(), Grid<int64_t, int>::kMissingWay);
+        for (uint32_t j = 0; j < ways.Size(); ++j) {
+            OsmModel::WayView way = ways.Get(j);
+            if (!seen_ways.insert(way.GetId()).second) {
+                continue;
+            }
+            buffer.Clear();
+            buffer.id = way.GetId();
+            buffer.node_ids.assign(way.GetNodeIds().begin(), way.GetNodeIds().end());
+            buffer.points.assign(way.GetPoints().begin(), way.GetPoints().end());
+            for (const OsmModel::Tag& tag : way.GetTags()) {
+                buffer.tags.push_back({string_id(tag.key), string_id(tag.value)});
+            }
+            taken_over[i][j] = osm_data->grid.RestoreWay(buffer);
+        }
+        if (part.grid.CountWays() > parts[largest]->grid.CountWays()) {
+            largest = i;
+        }
+    }
+    // the cells of the largest file are taken over, only the others are
+    // computed again
+    if (count) {
+        SortWays(osm_data.get(), &taken_over[largest]);
+        osm_data->grid.RestoreCells(parts[largest]->grid, taken_over[largest]);
+    }
+    osm_data->complete = complete;
+    PrintLoadReport(*osm_data, options, stats, start_time, threads);
+    return osm_data;
+}
+
+/* Node ID ranges of blobs that were added, removed or changed since the
+ * previous load. Only nodes within them may differ from the previous ones. */
+class DirtyRanges {
+    vector<pair<int64_t, int64_t>> ranges_;
+
+public:
+    void Add(int64_t min_id, int64_t max_id) {
+        if (min_id <= max_id) {
+            ranges_.push_back({min_id, max_id});
+        }
+    }
+
+    void Seal() {
+        sort(ranges_.begin(), ranges_.end());
+        size_t kept = 0;
+        for (const auto& range : ranges_) {
+            if (kept && range.first <= ranges_[kept - 1].second) {
+                ranges_[kept - 1].second = max(ranges_[kept - 1].second, range.second);
+            } else {
+                ranges_[kept++] = range;
+            }
+        }
+        ranges_.resize(kept);
+    }
+
+    bool Contains(int64_t id) const {
+        auto it = upper_bound(ranges_.begin(), ranges_.end(), make_pair(id, numeric_limits<int64_t>::max()));
+        return it != ranges_.begin() && id <= prev(it)->second;
+    }
+};
+
+bool TouchesDirtyNodes(const OsmData& previous, const BlobRecord& record, const DirtyRanges& dirty) {
+    for (int64_t ref : record.missing_refs) {
+        if (dirty.Contains(ref)) {
+            return true;
+        }
+    }
+    const OsmModel::WayStore& ways = previous.grid.GetWays();
+    for (uint32_t way : record.ways) {
+        for (int64_t id : ways.GetNodeIds(way)) {
+            if (dirty.Contains(id)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+OsmDataHolder UpdatePbfData(const OsmData& previous, const string& data_path, const string& state_path, const LoadOptions& options) {
+    cout << "Updating data from " << data_path << " and " << state_path << endl;
+    int threads = options.threads;
+    if (threads <= 0) {
+        threads = max(1, int(thread::hardware_concurrency()));
+    }
+    auto start_time = chrono::steady_clock::now();
+    OsmDataHolder osm_data = make_shared<OsmData>(previous.grid.GetCellSize());
+    // so that the tags of the ways taken over keep their string IDs
+    osm_data->strings = previous.strings;
+    osm_data->state = ReadState(state_path, &(osm_data->timestamp), &(osm_data->sequence));
+    if (!osm_data->timestamp.empty()) {
+        cout << "Timestamp: " << osm_data->timestamp << endl;
+    }
+
+    // hashes of all blobs by index, only data blobs get a record
+    vector<uint64_t> hashes;
+    vector<bool> data_blobs;
+    bool complete = ProcessBlocks(data_path, threads, options, [](BlobDecoder& /*decoder*/, const RawBlock& raw, DecodedBlock* result) {
+        if (raw.type == kOSMData) {
+            result->data_blob = true;
+            result->blob_hash = HashBytes(raw.Data(), raw.size);
+        }
+        return true;
+    }, [&](DecodedBlock& block) {
+        hashes.push_back(block.blob_hash);
+        data_blobs.push_back(block.data_blob);
+    });
+
+    // decodes the selected blobs again, failing if the file was replaced meanwhile
+    auto decode_blobs = [&](const vector<bool>& selected, const BlockDecodeOptions& decode_options, const function<void(int64_t, DecodedBlock&)>& merge) {
+        int64_t index = 0;
+        bool same_file = true;
+        bool decoded = ProcessBlocks(data_path, threads, options, [&](BlobDecoder& decoder, const RawBlock& raw, DecodedBlock* result) {
+            if (size_t(raw.index) >= selected.size() || !selected[raw.index]) {
+                return true;
+            }
+            return DecodeBlock(decoder, raw, decode_options, result);
+        }, [&](DecodedBlock& block) {
+            if (size_t(index) >= selected.size()) {
+                same_file = false;
+            } else if (selected[index]) {
+                if (block.blob_hash != hashes[index]) {
+                    same_file = false;
+                } else {
+                    merge(index, block);
+                }
+            }
+            ++index;
+        });
+        return decoded && same_file && size_t(index) == selected.size();
+    };
+
+    // each blob takes over the record of an identical previous one at most
+    unordered_multimap<uint64_t, size_t> unmatched;
+    for (size_t i = 0; i < previous.blobs.size(); ++i) {
+        unmatched.emplace(previous.blobs[i].hash, i);
+    }
+    size_t blobs_nr = hashes.size();
+    vector<int64_t> reused(blobs_nr, -1);
+    vector<bool> changed(blobs_nr, false);
+    for (size_t i = 0; i < blobs_nr; ++i) {
+        if (!data_blobs[i]) {
+            continue;
+        }
+        auto it = unmatched.find(hashes[i]);
+        if (it != unmatched.end()) {
+            reused[i] = it->second;
+            unmatched.erase(it);
+        } else {
+            changed[i] = true;
+        }
+    }
+    DirtyRanges dirty;
+    for (const auto& entry : unmatched) {
+        dirty.Add(previous.blobs[entry.second].min_node_id, previous.blobs[entry.second].max_node_id);
+    }
+
+    // new and changed blobs, nodes are kept whether referenced or not
+    map<int64_t, DecodedBlock> decoded;
+    BlockDecodeOptions full_options;
+    auto keep_decoded = [&](int64_t index, DecodedBlock& block) {
+        decoded[index] = move(block);
+    };
+    if (complete) {
+        complete = decode_blobs(changed, full_options, keep_decoded);
+    }
+    for (const auto& entry : decoded) {
+        dirty.Add(entry.second.min_node_id, entry.second.max_node_id);
+    }
+    dirty.Seal();
+
+    // unchanged blobs whose ways may resolve differently now
+    vector<bool> touched(blobs_nr, false);
+    bool any_touched = false;
+    for (size_t i = 0; i < blobs_nr; ++i) {
+        if (reused[i] >= 0 && TouchesDirtyNodes(previous, previous.blobs[reused[i]], dirty)) {
+            touched[i] = true;
+            any_touched = true;
+            reused[i] = -1;
+        }
+    }
+    if (complete && any_touched) {
+        complete = decode_blobs(touched, full_options, keep_decoded);
+    }
+
+    NodeIndex nodes;
+    for (const auto& entry : decoded) {
+        InsertNodes(entry.second, nodes);
+    }
+    SortedIdSet unresolved;
+    for (const auto& entry : decoded) {
+        vector<int64_t> refs;
+        for (int64_t ref : entry.second.way_refs) {
+            if (!nodes.Contains(ref)) {
+                refs.push_back(ref);
+            }
+        }
+        unresolved.Add(refs);
+    }
+    unresolved.Seal();
+    // a node outside the dirty ranges is the same as before, so it is taken
+    // from the previous ways
+    size_t shared_nodes = 0;
+    if (unresolved.Size()) {
+        const OsmModel::WayStore& ways = previous.grid.GetWays();
+        for (uint32_t i = 0; i < ways.Size(); ++i) {
+            auto point = ways.GetPoints(i).begin();
+            for (int64_t id : ways.GetNodeIds(i)) {
+                if (unresolved.Contains(id) && !dirty.Contains(id) && !nodes.Contains(id)) {
+                    nodes.Insert(id, point->lat, point->lon);
+                    ++shared_nodes;
+                }
+                ++point;
+            }
+        }
+    }
+    // the rest can only come from unchanged blobs no previous way used them from
+    SortedIdSet wanted;
+    vector<int64_t> remaining;
+    for (const auto& entry : decoded) {
+        for (int64_t ref : entry.second.way_refs) {
+            if (!nodes.Contains(ref)) {
+                remaining.push_back(ref);
+            }
+        }
+    }
+    wanted.Add(remaining);
+    wanted.Seal();
+    vector<bool> node_sources(blobs_nr, false);
+    bool any_node_sources = false;
+    for (size_t i = 0; i < blobs_nr; ++i) {
+        if (reused[i] >= 0 && wanted.ContainsAnyIn(previous.blobs[reused[i]].min_node_id, previous.blobs[reused[i]].max_node_id)) {
+            node_sources[i] = true;
+            any_node_sources = true;
+        }
+    }
+    if (complete && any_node_sources) {
+        BlockDecodeOptions nodes_options;
+        nodes_options.wanted_nodes = &wanted;
+        complete = decode_blobs(node_sources, nodes_options, [&](int64_t /*index*/, DecodedBlock& block) {
+            InsertNodes(block, nodes);
+        });
+    }
+
+    size_t reused_nr = 0;
+    size_t decoded_nr = decoded.size();
+    if (complete) {
+        vector<uint32_t> taken_over(previous.grid.CountWays(), Grid<int64_t, int>::kMissingWay);
+        for (size_t i = 0; i < blobs_nr; ++i) {
+            auto it = decoded.find(i);
+            if (it != decoded.end()) {
+                MergeWays(it->second, nodes, osm_data.get());
+                decoded.erase(it);
+            } else if (reused[i] >= 0) {
+                ReuseBlob(previous, previous.blobs[reused[i]], osm_data.get(), &taken_over);
+                ++reused_nr;
+            }
+        }
+        SortWays(osm_data.get(), &taken_over);
+        CompactStrings(osm_data.get());
+        osm_data->grid.RestoreCells(previous.grid, taken_over);
+    }
+    osm_data->complete = complete;
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "State " << osm_data->state << ":" << endl;
+    cout << "  Total number of strings: " << osm_data->strings.Size() << endl;
+    cout << "  Number of reused data blobs: " << reused_nr << " of " << osm_data->blobs.size() << endl;
+    cout << "  Number of decoded data blobs: " << decoded_nr << endl;
+    cout << "  Number of nodes taken from state " << previous.state << ": " << shared_nodes << endl;
+    cout << "  Total number of ways: " << osm_data->grid.CountWays() << endl;
+    cout << "  Number of skipped ways: " << osm_data->skipped_ways << endl;
+    cout << "  Number of partial ways: " << osm_data->partial_ways << endl;
+    cout << "  Updated in " << elapsed.count() << " ms by " << threads << " decoding thread(s)" << endl;
+    return osm_data;
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "model/model.h"
+
+#include "grid.h"
+#include "string_dictionary.h"
+
+using namespace std;
+
+/* Reads the state number, and the timestamp and the replication sequence
+ * number if asked for and present, of an Osmosis state file. A file with the
+ * states of several cities gives the oldest timestamp and no sequence. Gives
+ * 0 if the file is missing or has no valid state. */
+int64_t ReadState(const string& state_path, string* timestamp = nullptr, int64_t* sequence = nullptr);
+
+/* Not cryptographic, just enough to tell changed blobs apart. */
+uint64_t HashBytes(const uint8_t* data, size_t size);
+
+/* What one data blob of the PBF file contributed to OsmData. While the blob
+ * stays byte-identical and none of the nodes its ways refer to can have
+ * changed, a reload takes its ways over instead of decoding it again. */
+struct BlobRecord {
+    uint64_t hash = 0;
+    // IDs of all nodes the blob defines lie within; none if min > max
+    int64_t min_node_id = numeric_limits<int64_t>::max();
+    int64_t max_node_id = numeric_limits<int64_t>::min();
+    // indices of the ways of the blob in grid.GetWays(), in blob order
+    vector<uint32_t> ways;
+    int32_t skipped_ways = 0;
+    int32_t partial_ways = 0;
+    // refs no node was found for, the ways would change if one appeared
+    vector<int64_t> missing_refs;
+};
+
+struct OsmData {
+    // strings referred to by tags, interned across all blocks; data built
+    // from previous data starts with a copy of its strings, so that the
+    // tags of the ways it takes over keep their IDs
+    StringDictionary strings;
+    Grid<int64_t, int> grid;
+    int skipped_ways = 0;
+    int partial_ways = 0;
+    int64_t state = 0;
+    string timestamp;
+    // of the last change file applied on top of the PBF file, see
+    // osm_change.h, or the one the PBF file is at, as given in the state file
+    int64_t sequence = 0;
+    // set once every block of the file has been read and decoded
+    bool complete = false;
+    // data blobs in file order
+    vector<BlobRecord> blobs;
+
+    OsmData(int cell_size) :
+        grid(cell_size)
+    {}
+};
+
+typedef shared_ptr<OsmData> OsmDataHolder;
+
+/* Tags update_footways.py cuts the extract by. */
+extern const vector<pair<string, string>> kFootwayTags;
+
+/* Which ways are taken in, the way osmosis cuts an extract with a tag
+ * filter, --used-node and a bounding box. */
+struct WayFilter {
+    // a way needs one of these tags, unless empty
+    vector<pair<string, string>> tags;
+    // only nodes within one of these are kept, and only ways with at least
+    // one of them, unless empty
+    vector<Bbox<int64_t>> bboxes;
+};
+
+/* An input of a multi-file load, e.g. the extract of one region. */
+struct PbfInput {
+    string path;
+    WayFilter filter;
+};
+
+/* Parses "highway=footway,highway=cycleway". */
+bool ParseTagList(const string& s, vector<pair<string, string>>* tags);
+
+/* Parses "moscow.osm.pbf@36.65,55.33,38.50,56.10", a path with an optional
+ * bbox as west,south,east,north in degrees. Leaves the tags alone. */
+bool ParsePbfInput(const string& s, PbfInput* input);
+
+/* How far a load has got, for readiness reports. Blobs are counted as they
+ * are read, once for every pass over the file. */
+struct LoadProgress {
+    atomic<int64_t> bytes_read;
+    atomic<int64_t> bytes_total;
+
+    LoadProgress() : bytes_read(0), bytes_total(0) {}
+
+    double Fraction() const {
+        int64_t total = bytes_total;
+        return total > 0 ? min(1.0, double(bytes_read) / total) : 0.0;
+    }
+};
+
+struct LoadOptions {
+    // number of decoding workers, one per core if not positive
+    int threads = 0;
+    // make a first pass to collect node IDs referenced by ways and keep
+    // only those nodes on the second one
+    bool referenced_nodes_only = true;
+    // caps the rate blobs are read at, and so the memory bandwidth the
+    // whole pipeline takes, unless zero
+    int64_t max_read_bytes_per_second = 0;
+    // updated as the files are read, unless null
+    LoadProgress* progress = nullptr;
+};
+
+/* One thread reads raw blobs, workers inflate and parse them, and the
+ * calling thread merges the decoded blocks in file order. The id->node map
+ * is dropped as soon as the ways are resolved. Every load orders the ways
+ * of the result along a Hilbert curve, see Grid::SortWays. */
+OsmDataHolder OpenPbfData2(const string& data_path, const string& state_path, const LoadOptions& options = LoadOptions());
+
+/* Loads several files into one OsmData, filtering ways and nodes as they
+ * are decoded, so that nothing else is ever materialised. The files are
+ * loaded in parallel, each by its own share of the decoding threads, and
+ * merged in order. Ways are taken once even if several files have them.
+ * Ways without a node inside the bboxes count as skipped. No blob records
+ * are kept, as there is more than one file. */
+OsmDataHolder OpenPbfInputs(const vector<PbfInput>& inputs, const string& state_path, const LoadOptions& options = LoadOptions());
+
+/* Drops the strings no tag refers to any more, which data built from
+ * previous data would otherwise pile up forever, renumbering the tags. */
+void CompactStrings(OsmData* osm_data);
+
+/* Same as OpenPbfData2, but takes over the ways of every data blob that is
+ * byte-identical to one |previous| was built from, unless a node they refer
+ * to may have changed. Only the remaining blobs are decoded, the unchanged
+ * ways are copied over as they are, cells included. */
+OsmDataHolder UpdatePbfData(const OsmData& previous, const string& data_path, const string& state_path, const LoadOptions& options = LoadOptions());
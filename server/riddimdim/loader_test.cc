@@ -0,0 +1,193 @@
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "loader.h"
+#include "pbf_writer.h"
+
+using namespace std;
+
+int failures = 0;
+
+void Check(bool ok, const string& what) {
+    if (!ok) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+string TempPath(const string& name) {
+    const char* dir = getenv("TEST_TMPDIR");
+    return string(dir ? dir : "/tmp") + "/loader_test_" + name;
+}
+
+/* Ways of three nodes in a row, each with nodes of its own, except that
+ * ways 7 and 8 share a node. */
+struct TestWay {
+    int64_t id;
+    vector<int64_t> node_ids;
+    vector<OsmModel::Point> points;
+    vector<pair<string, string>> tags;
+};
+
+vector<TestWay> MakeWays() {
+    vector<TestWay> ways;
+    for (int64_t i = 0; i < 300; ++i) {
+        TestWay way;
+        way.id = 1000 + i;
+        for (int64_t j = 0; j < 3; ++j) {
+            way.node_ids.push_back(10 * i + j + 1);
+            way.points.push_back({int32_t(557000000 + 3000 * (i / 20) + 100 * j), int32_t(376000000 + 3000 * (i % 20))});
+        }
+        way.tags = {{"highway", "footway"}};
+        if (i % 3 == 0) {
+            way.tags.push_back({"surface", "asphalt"});
+        }
+        ways.push_back(way);
+    }
+    ways[8].node_ids[0] = ways[7].node_ids[2];
+    ways[8].points[0] = ways[7].points[2];
+    ways[30].tags.push_back({"name", "only in the first file"});
+    return ways;
+}
+
+bool WriteWays(const vector<TestWay>& ways, const string& path) {
+    OsmData data(1e4);
+    for (const TestWay& way : ways) {
+        OsmModel::WayBuffer buffer;
+        buffer.id = way.id;
+        buffer.node_ids = way.node_ids;
+        buffer.points = way.points;
+        for (const auto& tag : way.tags) {
+            buffer.tags.push_back({data.strings.Intern(tag.first), data.strings.Intern(tag.second)});
+        }
+        data.grid.RestoreWay(buffer);
+    }
+    PbfWriteOptions options;
+    // many small blobs, so that most of them stay the same
+    options.block_size = 16;
+    return WritePbfFile(data, path, options);
+}
+
+/* Ways by ID with nodes, points and tag strings, the ways of every cell
+ * by ID and the blob records, so that data loaded either way compares
+ * whatever the order of the ways and the IDs of the strings. */
+string Dump(const OsmData& data) {
+    const OsmModel::WayStore& ways = data.grid.GetWays();
+    map<int64_t, string> by_id;
+    for (uint32_t i = 0; i < ways.Size(); ++i) {
+        stringstream s;
+        OsmModel::WayView way = ways.Get(i);
+        OsmModel::PointRange points = way.GetPoints();
+        auto point = points.begin();
+        for (int64_t node_id : way.GetNodeIds()) {
+            s << node_id << ":" << point->lat << "," << point->lon << " ";
+            ++point;
+        }
+        for (const OsmModel::Tag& tag : way.GetTags()) {
+            s << *data.strings.Get(tag.key) << "=" << *data.strings.Get(tag.value) << " ";
+        }
+        by_id[way.GetId()] = s.str();
+    }
+    stringstream s;
+    for (const auto& way : by_id) {
+        s << way.first << " " << way.second << "\n";
+    }
+    for (const auto& cell : data.grid.GetCells()) {
+        s << cell.first.first << "," << cell.first.second << ":";
+        for (uint32_t way : cell.second) {
+            s << " " << ways.GetId(way);
+        }
+        s << "\n";
+    }
+    for (const BlobRecord& record : data.blobs) {
+        s << record.hash << " " << record.min_node_id << " " << record.max_node_id << ":";
+        for (uint32_t way : record.ways) {
+            s << " " << ways.GetId(way);
+        }
+        s << "\n";
+    }
+    s << data.skipped_ways << " " << data.partial_ways << " " << data.strings.Size() << "\n";
+    return s.str();
+}
+
+int CountReusedBlobs(const string& log) {
+    const string kPrefix = "Number of reused data blobs: ";
+    size_t pos = log.find(kPrefix);
+    return pos == string::npos ? -1 : atoi(log.c_str() + pos + kPrefix.size());
+}
+
+void TestMergedState() {
+    // as update_footways.py writes it: its own state, then those of the cities
+    string path = TempPath("merged_state.txt");
+    ofstream(path) << "1600000300\n"
+        << "#Sun Sep 13 12:00:00 UTC 2020\nsequenceNumber=4120\ntimestamp=2020-09-13T12\\:00\\:00Z\n"
+        << "#Sun Sep 13 11:00:00 UTC 2020\nsequenceNumber=3871\ntimestamp=2020-09-13T11\\:00\\:00Z\n";
+    string timestamp;
+    int64_t sequence = -1;
+    Check(ReadState(path, &timestamp, &sequence) == 1600000300, "merged state number");
+    Check(timestamp == "2020-09-13T11:00:00Z", "the oldest timestamp of a merged state: " + timestamp);
+    Check(sequence == -1, "no sequence of a merged state: " + to_string(sequence));
+
+    ofstream(path) << "1600000300\nsequenceNumber=4120\ntimestamp=2020-09-13T12\\:00\\:00Z\n";
+    Check(ReadState(path, &timestamp, &sequence) == 1600000300 && sequence == 4120 &&
+        timestamp == "2020-09-13T12:00:00Z", "state of a single city");
+}
+
+int main() {
+    TestMergedState();
+    string state_path = TempPath("state.txt");
+    ofstream(state_path) << "1600000000\ntimestamp=2020-09-13T12\\:00\\:00Z\n";
+    string first_path = TempPath("first.pbf");
+    string second_path = TempPath("second.pbf");
+
+    vector<TestWay> ways = MakeWays();
+    Check(WriteWays(ways, first_path), "first file is written");
+    // a moved node, in a blob of nodes and in the shared node of two ways
+    // whose blob of ways stays the same
+    ways[5].points[1].lat += 50;
+    ways[7].points[2].lon += 50;
+    ways[8].points[0].lon += 50;
+    ways[10].tags.push_back({"surface", "gravel"});
+    ways[30].tags.pop_back();
+    // another way in place of a deleted one, so that the blocks keep their
+    // bounds
+    ways[20].id = 5000;
+    Check(WriteWays(ways, second_path), "second file is written");
+
+    LoadOptions options;
+    options.threads = 2;
+    OsmDataHolder first = OpenPbfData2(first_path, state_path, options);
+    OsmDataHolder full = OpenPbfData2(second_path, state_path, options);
+    Check(first->complete && full->complete, "files load completely");
+    Check(full->grid.CountWays() == 300, "second file has all ways");
+
+    stringstream log;
+    streambuf* cout_buffer = cout.rdbuf(log.rdbuf());
+    OsmDataHolder updated = UpdatePbfData(*first, second_path, state_path, options);
+    cout.rdbuf(cout_buffer);
+    Check(updated->complete, "update is complete");
+    int reused = CountReusedBlobs(log.str());
+    Check(reused > 0 && reused < int(updated->blobs.size()), "some blobs are reused, but not all: " + to_string(reused));
+    Check(Dump(*updated) == Dump(*full), "update gives the same data as a full load");
+
+    // nothing changed at all
+    log.str("");
+    cout.rdbuf(log.rdbuf());
+    OsmDataHolder same = UpdatePbfData(*full, second_path, state_path, options);
+    cout.rdbuf(cout_buffer);
+    Check(CountReusedBlobs(log.str()) == int(same->blobs.size()), "all blobs of the same file are reused");
+    Check(Dump(*same) == Dump(*full), "update from the same file changes nothing");
+
+    if (failures) {
+        cerr << failures << " checks failed" << endl;
+        return 1;
+    }
+    cout << "OK" << endl;
+    return 0;
+}
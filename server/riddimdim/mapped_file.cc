@@ -0,0 +1,48 @@
+#include "mapped_file.h"
+
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const string& path) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+        cerr << "failed to open " << path << endl;
+        return;
+    }
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        cerr << "failed to stat " << path << endl;
+        return;
+    }
+    size_ = size_t(st.st_size);
+    if (size_ > 0) {
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+        if (addr == MAP_FAILED) {
+            cerr << "failed to mmap " << path << endl;
+            size_ = 0;
+            return;
+        }
+        data_ = static_cast<const uint8_t*>(addr);
+    }
+    valid_ = true;
+}
+
+MappedFile::~MappedFile() {
+    if (data_) {
+        munmap(const_cast<uint8_t*>(data_), size_);
+    }
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+void MappedFile::AdviseSequential() const {
+    if (data_) {
+        madvise(const_cast<uint8_t*>(data_), size_, MADV_SEQUENTIAL);
+        madvise(const_cast<uint8_t*>(data_), size_, MADV_WILLNEED);
+    }
+}
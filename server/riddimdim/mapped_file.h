@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+using namespace std;
+
+/* Read-only memory mapping of a whole file. */
+class MappedFile {
+    int fd_ = -1;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    bool valid_ = false;
+
+public:
+    explicit MappedFile(const string& path);
+
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    bool IsValid() const {
+        return valid_;
+    }
+
+    const uint8_t* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    /* Stays open as long as the mapping, so that parts of the very same
+     * file can be mapped on their own. */
+    int Descriptor() const {
+        return fd_;
+    }
+
+    /* Hints the kernel that the file is going to be read front to back. */
+    void AdviseSequential() const;
+};
@@ -0,0 +1,52 @@
+#include "metrics.h"
+
+#include <cmath>
+
+LatencyHistogram::LatencyHistogram() : count_(0), sum_us_(0) {
+    for (atomic<uint64_t>& bucket : buckets_) {
+        bucket = 0;
+    }
+}
+
+double LatencyHistogram::UpperBound(int bucket) {
+    // 100 us, doubled per bucket
+    return 1e-4 * pow(2.0, bucket);
+}
+
+void LatencyHistogram::Record(double seconds) {
+    int bucket = 0;
+    while (bucket < kBuckets && seconds > UpperBound(bucket)) {
+        ++bucket;
+    }
+    ++buckets_[bucket];
+    ++count_;
+    sum_us_ += uint64_t(seconds * 1e6);
+}
+
+double LatencyHistogram::Quantile(double q) const {
+    uint64_t total = count_;
+    if (!total) {
+        return 0;
+    }
+    uint64_t rank = uint64_t(ceil(q * total));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+        seen += buckets_[bucket];
+        if (seen >= rank) {
+            return UpperBound(bucket);
+        }
+    }
+    return INFINITY;
+}
+
+void LatencyHistogram::Write(const string& name, const string& labels, ostream& out) const {
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < kBuckets; ++bucket) {
+        seen += buckets_[bucket];
+        out << name << "_bucket{" << labels << ",le=\"" << UpperBound(bucket) << "\"} " << seen << "\n";
+    }
+    seen += buckets_[kBuckets];
+    out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << seen << "\n";
+    out << name << "_sum{" << labels << "} " << sum_us_ / 1e6 << "\n";
+    out << name << "_count{" << labels << "} " << count_ << "\n";
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+using namespace std;
+
+/* Lock-free latency histogram with exponential buckets, from 100 us up to
+ * about 100 s, exported in the Prometheus text format. */
+class LatencyHistogram {
+public:
+    static const int kBuckets = 22;
+
+    LatencyHistogram();
+
+    void Record(double seconds);
+
+    uint64_t Count() const {
+        return count_;
+    }
+
+    /* Upper bound of the bucket the |q| quantile falls into, 0 if empty. */
+    double Quantile(double q) const;
+
+    /* Writes _bucket, _sum and _count series of |name| with |labels|, which
+     * look like `status="200",reload="0"`. */
+    void Write(const string& name, const string& labels, ostream& out) const;
+
+private:
+    atomic<uint64_t> buckets_[kBuckets + 1];
+    atomic<uint64_t> count_;
+    atomic<uint64_t> sum_us_;
+
+    static double UpperBound(int bucket);
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "model/model.h"
+
+using namespace std;
+
+/* Open-addressing hash table from node ID to coordinates, used while ways
+ * are resolved. IDs and coordinates are stored inline in one flat array,
+ * so that a lookup is a single probe sequence over contiguous memory. */
+class NodeIndex {
+    static constexpr int64_t kEmptyId = numeric_limits<int64_t>::min();
+    static constexpr double kMaxLoadFactor = 0.6;
+
+    struct Slot {
+        int64_t id;
+        OsmModel::Point point;
+    };
+
+    vector<Slot> slots_;
+    size_t size_ = 0;
+    size_t mask_ = 0;
+    int shift_ = 64;
+
+    size_t Home(int64_t id) const {
+        // Fibonacci hashing spreads the mostly sequential OSM IDs
+        return size_t((uint64_t(id) * 0x9E3779B97F4A7C15ull) >> shift_);
+    }
+
+    Slot* Probe(int64_t id) {
+        size_t i = Home(id);
+        while (slots_[i].id != kEmptyId && slots_[i].id != id) {
+            i = (i + 1) & mask_;
+        }
+        return &slots_[i];
+    }
+
+    void Rehash(size_t capacity) {
+        vector<Slot> old;
+        old.swap(slots_);
+        slots_.resize(capacity, Slot{kEmptyId, {0, 0}});
+        mask_ = capacity - 1;
+        shift_ = 64;
+        for (size_t c = capacity; c > 1; c >>= 1) {
+            --shift_;
+        }
+        for (const Slot& slot : old) {
+            if (slot.id != kEmptyId) {
+                *Probe(slot.id) = slot;
+            }
+        }
+    }
+
+public:
+    NodeIndex() {
+        Rehash(16);
+    }
+
+    void Reserve(size_t count) {
+        size_t capacity = slots_.size();
+        while (capacity * kMaxLoadFactor < count) {
+            capacity *= 2;
+        }
+        if (capacity != slots_.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    /* A repeated ID replaces the previous node, as the map did. */
+    void Insert(int64_t id, int32_t lat, int32_t lon) {
+        Reserve(size_ + 1);
+        Slot* slot = Probe(id);
+        if (slot->id == kEmptyId) {
+            slot->id = id;
+            ++size_;
+        }
+        slot->point = {lat, lon};
+    }
+
+    bool Contains(int64_t id) {
+        return Probe(id)->id != kEmptyId;
+    }
+
+    /* Returns null for unknown IDs. */
+    const OsmModel::Point* Resolve(int64_t id) {
+        Slot* slot = Probe(id);
+        return slot->id == kEmptyId ? nullptr : &slot->point;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+};
@@ -0,0 +1,554 @@
+#include "osm_change.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <dirent.h>
+#include <zlib.h>
+
+struct XmlTag {
+    string name;
+    bool closing = false;
+    bool self_closing = false;
+    vector<pair<string, string>> attributes;
+
+    const string* Attribute(const char* key) const {
+        for (const auto& attribute : attributes) {
+            if (attribute.first == key) {
+                return &attribute.second;
+            }
+        }
+        return nullptr;
+    }
+};
+
+void AppendUtf8(uint32_t code, string* out) {
+    if (code < 0x80) {
+        out->push_back(char(code));
+    } else if (code < 0x800) {
+        out->push_back(char(0xC0 | (code >> 6)));
+        out->push_back(char(0x80 | (code & 0x3F)));
+    } else if (code < 0x10000) {
+        out->push_back(char(0xE0 | (code >> 12)));
+        out->push_back(char(0x80 | ((code >> 6) & 0x3F)));
+        out->push_back(char(0x80 | (code & 0x3F)));
+    } else {
+        out->push_back(char(0xF0 | (code >> 18)));
+        out->push_back(char(0x80 | ((code >> 12) & 0x3F)));
+        out->push_back(char(0x80 | ((code >> 6) & 0x3F)));
+        out->push_back(char(0x80 | (code & 0x3F)));
+    }
+}
+
+string DecodeEntities(const char* begin, const char* end) {
+    string result;
+    result.reserve(end - begin);
+    const char* p = begin;
+    while (p < end) {
+        if (*p != '&') {
+            result.push_back(*p++);
+            continue;
+        }
+        const char* semicolon = (const char*) memchr(p, ';', end - p);
+        if (!semicolon) {
+            result.append(p, end);
+            break;
+        }
+        string entity(p + 1, semicolon);
+        if (entity == "amp") {
+            result.push_back('&');
+        } else if (entity == "lt") {
+            result.push_back('<');
+        } else if (entity == "gt") {
+            result.push_back('>');
+        } else if (entity == "quot") {
+            result.push_back('"');
+        } else if (entity == "apos") {
+            result.push_back('\'');
+        } else if (entity.size() > 1 && entity[0] == '#') {
+            bool hex = entity[1] == 'x' || entity[1] == 'X';
+            AppendUtf8(uint32_t(strtoul(entity.c_str() + (hex ? 2 : 1), nullptr, hex ? 16 : 10)), &result);
+        } else {
+            result.append(p, semicolon + 1);
+        }
+        p = semicolon + 1;
+    }
+    return result;
+}
+
+/* Just enough of XML for osmChange: elements with attributes, while text,
+ * comments and processing instructions are skipped. */
+class XmlScanner {
+    const char* p_;
+    const char* end_;
+
+    void SkipSpaces() {
+        while (p_ < end_ && isspace((unsigned char) *p_)) {
+            ++p_;
+        }
+    }
+
+    bool SkipPast(const char* terminator) {
+        size_t n = strlen(terminator);
+        for (; p_ + n <= end_; ++p_) {
+            if (memcmp(p_, terminator, n) == 0) {
+                p_ += n;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    const char* ReadName() {
+        const char* begin = p_;
+        while (p_ < end_ && !isspace((unsigned char) *p_) && *p_ != '/' && *p_ != '>' && *p_ != '=') {
+            ++p_;
+        }
+        return begin;
+    }
+
+public:
+    XmlScanner(const char* data, size_t size) : p_(data), end_(data + size) {}
+
+    bool AtEnd() const {
+        return p_ >= end_;
+    }
+
+    /* Moves to the next start or end tag. Returns false at the end or on
+     * malformed input, see AtEnd. */
+    bool Next(XmlTag* tag) {
+        while (true) {
+            p_ = (const char*) memchr(p_, '<', end_ - p_);
+            if (!p_) {
+                p_ = end_;
+                return false;
+            }
+            if (end_ - p_ >= 4 && memcmp(p_, "<!--", 4) == 0) {
+                if (!SkipPast("-->")) {
+                    return false;
+                }
+            } else if (end_ - p_ >= 2 && (p_[1] == '?' || p_[1] == '!')) {
+                if (!SkipPast(">")) {
+                    return false;
+                }
+            } else {
+                break;
+            }
+        }
+        ++p_;
+        tag->closing = p_ < end_ && *p_ == '/';
+        tag->self_closing = false;
+        tag->attributes.clear();
+        if (tag->closing) {
+            ++p_;
+        }
+        const char* name = ReadName();
+        tag->name.assign(name, p_);
+        while (true) {
+            SkipSpaces();
+            if (p_ >= end_) {
+                return false;
+            }
+            if (*p_ == '>') {
+                ++p_;
+                return !tag->name.empty();
+            }
+            if (*p_ == '/') {
+                tag->self_closing = true;
+                ++p_;
+                continue;
+            }
+            const char* key = ReadName();
+            string key_string(key, p_);
+            SkipSpaces();
+            if (p_ >= end_ || *p_ != '=' || key_string.empty()) {
+                return false;
+            }
+            ++p_;
+            SkipSpaces();
+            if (p_ >= end_ || (*p_ != '"' && *p_ != '\'')) {
+                return false;
+            }
+            char quote = *p_++;
+            const char* value = p_;
+            p_ = (const char*) memchr(p_, quote, end_ - p_);
+            if (!p_) {
+                p_ = end_;
+                return false;
+            }
+            tag->attributes.emplace_back(move(key_string), DecodeEntities(value, p_));
+            ++p_;
+        }
+    }
+};
+
+int64_t ParseId(const string* value) {
+    return value ? strtoll(value->c_str(), nullptr, 10) : 0;
+}
+
+int32_t ParseCoordinate(const string* value) {
+    return value ? int32_t(llround(strtod(value->c_str(), nullptr) * 1e7)) : 0;
+}
+
+bool ParseOsmChange(const char* data, size_t size, OsmChange* change) {
+    XmlScanner scanner(data, size);
+    XmlTag tag;
+    bool in_action = false;
+    ChangeAction action = ChangeAction::kCreate;
+    // the way whose refs and tags follow, if any
+    ChangedWay* way = nullptr;
+    while (scanner.Next(&tag)) {
+        if (tag.closing) {
+            if (tag.name == "way") {
+                way = nullptr;
+            } else if (tag.name == "create" || tag.name == "modify" || tag.name == "delete") {
+                in_action = false;
+            }
+            continue;
+        }
+        if (tag.name == "create" || tag.name == "modify" || tag.name == "delete") {
+            in_action = true;
+            action = tag.name == "create" ? ChangeAction::kCreate :
+                     tag.name == "modify" ? ChangeAction::kModify : ChangeAction::kDelete;
+        } else if (!in_action) {
+            continue;
+        } else if (tag.name == "node") {
+            const string* timestamp = tag.Attribute("timestamp");
+            change->nodes.push_back({action, ParseId(tag.Attribute("id")),
+                                     ParseCoordinate(tag.Attribute("lat")), ParseCoordinate(tag.Attribute("lon")),
+                                     timestamp ? *timestamp : string()});
+        } else if (tag.name == "way") {
+            const string* timestamp = tag.Attribute("timestamp");
+            change->ways.push_back({action, ParseId(tag.Attribute("id")), {}, {}, timestamp ? *timestamp : string()});
+            way = tag.self_closing ? nullptr : &change->ways.back();
+        } else if (tag.name == "nd" && way) {
+            way->refs.push_back(ParseId(tag.Attribute("ref")));
+        } else if (tag.name == "tag" && way) {
+            const string* key = tag.Attribute("k");
+            const string* value = tag.Attribute("v");
+            if (key && value) {
+                way->tags.emplace_back(*key, *value);
+            }
+        }
+    }
+    if (!scanner.AtEnd()) {
+        cerr << "malformed osmChange XML" << endl;
+        return false;
+    }
+    return true;
+}
+
+bool ReadOsmChange(const string& path, OsmChange* change) {
+    gzFile file = gzopen(path.c_str(), "rb");
+    if (!file) {
+        cerr << "failed to open " << path << endl;
+        return false;
+    }
+    string data;
+    char buffer[1 << 16];
+    int read;
+    while ((read = gzread(file, buffer, sizeof(buffer))) > 0) {
+        data.append(buffer, read);
+    }
+    bool ok = read == 0;
+    gzclose(file);
+    if (!ok) {
+        cerr << "failed to read " << path << endl;
+        return false;
+    }
+    return ParseOsmChange(data.data(), data.size(), change);
+}
+
+/* Both are ISO 8601 in UTC, as in replication state files, so they compare
+ * as strings. */
+bool IsNewer(const string& timestamp, const string& data_timestamp) {
+    return timestamp.empty() || data_timestamp.empty() || timestamp > data_timestamp;
+}
+
+bool PassesFilter(const ChangedWay& way, const vector<OsmModel::Point>& points, const WayFilter& filter) {
+    bool tagged = filter.tags.empty();
+    for (const auto& tag : way.tags) {
+        if (find(filter.tags.begin(), filter.tags.end(), tag) != filter.tags.end()) {
+            tagged = true;
+            break;
+        }
+    }
+    if (!tagged) {
+        return false;
+    }
+    if (filter.bboxes.empty()) {
+        return true;
+    }
+    for (const OsmModel::Point& point : points) {
+        for (const Bbox<int64_t>& bbox : filter.bboxes) {
+            if (bbox.west_ <= point.lon && point.lon <= bbox.east_ &&
+                    bbox.south_ <= point.lat && point.lat <= bbox.north_) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+OsmDataHolder ApplyOsmChange(const OsmData& current, const OsmChange& change, const WayFilter& filter, int64_t sequence) {
+    auto start_time = chrono::steady_clock::now();
+    // the last version of every object the change has for the data
+    unordered_map<int64_t, const ChangedNode*> changed_nodes;
+    for (const ChangedNode& node : change.nodes) {
+        if (IsNewer(node.timestamp, current.timestamp)) {
+            changed_nodes[node.id] = &node;
+        }
+    }
+    unordered_map<int64_t, const ChangedWay*> changed_ways;
+    for (const ChangedWay& way : change.ways) {
+        if (IsNewer(way.timestamp, current.timestamp)) {
+            changed_ways[way.id] = &way;
+        }
+    }
+
+    // coordinates of the nodes ways may refer to: changed ones are from
+    // the change, the others from the current ways
+    unordered_map<int64_t, OsmModel::Point> nodes;
+    for (const auto& entry : changed_nodes) {
+        const ChangedNode& node = *entry.second;
+        if (node.action != ChangeAction::kDelete) {
+            nodes[node.id] = {node.lat, node.lon};
+        }
+    }
+    unordered_set<int64_t> wanted;
+    for (const auto& entry : changed_ways) {
+        for (int64_t ref : entry.second->refs) {
+            if (!changed_nodes.count(ref)) {
+                wanted.insert(ref);
+            }
+        }
+    }
+
+    OsmDataHolder osm_data = make_shared<OsmData>(current.grid.GetCellSize());
+    osm_data->strings = current.strings;
+    osm_data->state = current.state;
+    // the data is now as new as the newest object of the change
+    osm_data->timestamp = current.timestamp;
+    for (const ChangedNode& node : change.nodes) {
+        osm_data->timestamp = max(osm_data->timestamp, node.timestamp);
+    }
+    for (const ChangedWay& way : change.ways) {
+        osm_data->timestamp = max(osm_data->timestamp, way.timestamp);
+    }
+    osm_data->sequence = sequence;
+    osm_data->skipped_ways = current.skipped_ways;
+    osm_data->partial_ways = current.partial_ways;
+    osm_data->complete = current.complete;
+
+    int kept = 0, rebuilt = 0, removed = 0, added = 0;
+    unordered_set<int64_t> existing;
+    const OsmModel::WayStore& ways = current.grid.GetWays();
+    // ways the change leaves alone are copied over in runs, the others are
+    // resolved into |fresh| and merged in between them
+    vector<bool> unchanged(ways.Size(), false);
+    vector<OsmModel::WayBuffer> fresh;
+    OsmModel::WayBuffer buffer;
+    for (uint32_t i = 0; i < ways.Size(); ++i) {
+        OsmModel::WayView way = ways.Get(i);
+        OsmModel::Range<int64_t> node_ids = way.GetNodeIds();
+        bool moved = false;
+        auto point = way.GetPoints().begin();
+        for (int64_t id : node_ids) {
+            if (!wanted.empty() && wanted.count(id)) {
+                nodes.emplace(id, *point);
+            }
+            moved = moved || changed_nodes.count(id);
+            ++point;
+        }
+        if (changed_ways.count(way.GetId())) {
+            // replaced or deleted below
+            existing.insert(way.GetId());
+            continue;
+        }
+        if (!moved) {
+            unchanged[i] = true;
+            ++kept;
+            continue;
+        }
+        buffer.Clear();
+        buffer.id = way.GetId();
+        point = way.GetPoints().begin();
+        // a deleted node cuts the way as a missing ref does in the loader,
+        // instead of joining its neighbours with a segment that is not there
+        for (int64_t id : node_ids) {
+            OsmModel::Point position = *point;
+            ++point;
+            if (changed_nodes.count(id)) {
+                auto node = nodes.find(id);
+                if (node == nodes.end()) {
+                    if (!buffer.node_ids.empty()) {
+                        break;
+                    }
+                    continue;
+                }
+                position = node->second;
+            }
+            buffer.node_ids.push_back(id);
+            buffer.points.push_back(position);
+        }
+        if (buffer.node_ids.empty()) {
+            ++removed;
+            continue;
+        }
+        buffer.tags.assign(way.GetTags().begin(), way.GetTags().end());
+        fresh.push_back(buffer);
+        ++rebuilt;
+    }
+
+    for (const ChangedWay& way : change.ways) {
+        auto it = changed_ways.find(way.id);
+        if (it == changed_ways.end() || it->second != &way) {
+            // an older version of a way the change has again later
+            continue;
+        }
+        bool existed = existing.count(way.id);
+        buffer.Clear();
+        buffer.id = way.id;
+        if (way.action != ChangeAction::kDelete) {
+            // same as the loader: refs missing before the first known node
+            // are skipped, and the way is cut at the first one after it
+            for (int64_t ref : way.refs) {
+                auto node = nodes.find(ref);
+                if (node != nodes.end()) {
+                    buffer.node_ids.push_back(ref);
+                    buffer.points.push_back(node->second);
+                } else if (!buffer.node_ids.empty()) {
+                    break;
+                }
+            }
+        }
+        if (buffer.node_ids.empty() || !PassesFilter(way, buffer.points, filter)) {
+            removed += existed;
+            continue;
+        }
+        for (const auto& tag : way.tags) {
+            buffer.tags.push_back({osm_data->strings.Intern(tag.first), osm_data->strings.Intern(tag.second)});
+        }
+        fresh.push_back(buffer);
+        if (existed) {
+            ++rebuilt;
+        } else {
+            ++added;
+        }
+    }
+
+    // the current ways are in the order of Grid::SortWays already, so the
+    // fresh ones are put in their places of that order instead of sorting
+    // everything again
+    vector<pair<uint64_t, uint32_t>> order;
+    for (uint32_t i = 0; i < fresh.size(); ++i) {
+        order.push_back({Grid<int64_t, int>::GetWayOrder(fresh[i].points), i});
+    }
+    sort(order.begin(), order.end());
+    // ways taken over as they are keep their cells
+    vector<uint32_t> taken_over(ways.Size(), Grid<int64_t, int>::kMissingWay);
+    auto copy_unchanged = [&](uint32_t begin, uint32_t end) {
+        while (begin < end) {
+            if (!unchanged[begin]) {
+                ++begin;
+                continue;
+            }
+            uint32_t run_end = begin;
+            while (run_end < end && unchanged[run_end]) {
+                ++run_end;
+            }
+            uint32_t index = osm_data->grid.RestoreWayRange(ways, begin, run_end);
+            for (uint32_t i = begin; i < run_end; ++i) {
+                taken_over[i] = index++;
+            }
+            begin = run_end;
+        }
+    };
+    uint32_t next = 0;
+    for (const auto& entry : order) {
+        uint32_t low = next;
+        uint32_t high = ways.Size();
+        while (low < high) {
+            uint32_t middle = low + (high - low) / 2;
+            if (Grid<int64_t, int>::GetWayOrder(ways.GetPoints(middle)) <= entry.first) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        copy_unchanged(next, low);
+        next = low;
+        osm_data->grid.RestoreWay(fresh[entry.second]);
+    }
+    copy_unchanged(next, ways.Size());
+    CompactStrings(osm_data.get());
+    osm_data->grid.RestoreCells(current.grid, taken_over);
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "Change " << sequence << " is applied to state " << osm_data->state << ":" << endl;
+    cout << "  Timestamp: " << osm_data->timestamp << endl;
+    cout << "  Changed nodes: " << changed_nodes.size() << ", changed ways: " << changed_ways.size() << endl;
+    cout << "  Ways kept: " << kept << ", rebuilt: " << rebuilt << ", added: " << added << ", removed: " << removed << endl;
+    cout << "  Total number of ways: " << osm_data->grid.CountWays() << endl;
+    cout << "  Applied in " << elapsed.count() << " ms" << endl;
+    return osm_data;
+}
+
+/* Sequence number of a change file name, or -1 for other files. */
+int64_t ChangeFileSequence(const string& name) {
+    size_t digits = 0;
+    while (digits < name.size() && isdigit((unsigned char) name[digits])) {
+        ++digits;
+    }
+    string suffix = name.substr(digits);
+    if (digits == 0 || (suffix != ".osc.gz" && suffix != ".osc")) {
+        return -1;
+    }
+    return strtoll(name.c_str(), nullptr, 10);
+}
+
+OsmDataHolder ApplyPendingChanges(const OsmDataHolder& current, const string& changes_dir, const WayFilter& filter) {
+    DIR* dir = opendir(changes_dir.c_str());
+    if (!dir) {
+        cerr << "failed to open " << changes_dir << endl;
+        return current;
+    }
+    vector<pair<int64_t, string>> files;
+    while (dirent* entry = readdir(dir)) {
+        int64_t sequence = ChangeFileSequence(entry->d_name);
+        if (sequence > current->sequence) {
+            files.emplace_back(sequence, changes_dir + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    sort(files.begin(), files.end());
+
+    // consecutive files add up to one change, later objects win
+    OsmChange change;
+    int64_t sequence = current->sequence;
+    for (const auto& file : files) {
+        if (sequence && file.first != sequence + 1) {
+            cerr << "change " << sequence + 1 << " is missing in " << changes_dir << endl;
+            break;
+        }
+        OsmChange file_change;
+        if (!ReadOsmChange(file.second, &file_change)) {
+            break;
+        }
+        move(file_change.nodes.begin(), file_change.nodes.end(), back_inserter(change.nodes));
+        move(file_change.ways.begin(), file_change.ways.end(), back_inserter(change.ways));
+        sequence = file.first;
+    }
+    if (sequence == current->sequence) {
+        return current;
+    }
+    return ApplyOsmChange(*current, change, filter, sequence);
+}
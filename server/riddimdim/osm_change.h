@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "loader.h"
+
+using namespace std;
+
+/* Contents of an osmChange file, the format of OSM replication diffs. Only
+ * nodes and ways are kept, relations are of no use here. */
+
+enum class ChangeAction {
+    kCreate,
+    kModify,
+    kDelete,
+};
+
+struct ChangedNode {
+    ChangeAction action;
+    int64_t id;
+    // in 1e-7 degrees, as in the model; none for deletions
+    int32_t lat;
+    int32_t lon;
+    string timestamp;
+};
+
+struct ChangedWay {
+    ChangeAction action;
+    int64_t id;
+    vector<int64_t> refs;
+    vector<pair<string, string>> tags;
+    string timestamp;
+};
+
+struct OsmChange {
+    vector<ChangedNode> nodes;
+    vector<ChangedWay> ways;
+};
+
+/* Parses osmChange XML. */
+bool ParseOsmChange(const char* data, size_t size, OsmChange* change);
+
+/* Reads an osmChange file, gzipped or not. */
+bool ReadOsmChange(const string& path, OsmChange* change);
+
+/* Returns |current| with |change| applied, copying everything the change
+ * does not touch in bulk. Created and modified ways are taken in if they
+ * pass |filter|, the same one the extract was cut with. Ways that refer to
+ * moved nodes are rebuilt, and cut at deleted ones like at missing refs.
+ * Only the ways the change touches are sorted into the Hilbert order of
+ * the rest. Objects not newer than the timestamp of the data are skipped,
+ * as the PBF file has them already, and the data takes the timestamp of
+ * the newest object of the change. Refs to nodes that are neither in the
+ * change nor in the current ways cannot be resolved and are dropped the
+ * way the loader drops them, until the next full load brings those nodes
+ * in. Blob records are not carried over, so the next reload is a full
+ * one. */
+OsmDataHolder ApplyOsmChange(const OsmData& current, const OsmChange& change, const WayFilter& filter, int64_t sequence);
+
+/* Applies the change files in |changes_dir| that follow the sequence of
+ * |current|, in order. Data fresh from a PBF file is at the sequence number
+ * of its state file, so only the changes since are applied. The files are named after their replication
+ * sequence numbers, e.g. 4321.osc.gz. Stops at a gap in the sequence or at
+ * a file that fails to read. Returns |current| if nothing was applied. */
+OsmDataHolder ApplyPendingChanges(const OsmDataHolder& current, const string& changes_dir, const WayFilter& filter);
@@ -0,0 +1,267 @@
+#include "pbf_reader.h"
+
+#include <cstring>
+
+#include <arpa/inet.h>
+
+#include <google/protobuf/wire_format_lite.h>
+
+using google::protobuf::internal::WireFormatLite;
+
+const string kOSMHeader = "OSMHeader";
+const string kOSMData = "OSMData";
+
+void PrintHeaderBlock(const OSMPBF::HeaderBlock& hb) {
+    if (hb.has_bbox()) {
+        cout << "has bbox" << endl;
+    }
+    int n = hb.required_features_size();
+    cout << n << " required_features" << endl;
+    for (int i = 0; i < n; ++i) {
+        cout << "  - " << hb.required_features(i) << endl;
+    }
+    n = hb.optional_features_size();
+    cout << n << "optional_features" << endl;
+    for (int i = 0; i < n; ++i) {
+        cout << "  - " << hb.optional_features(i) << endl;
+    }
+    if (hb.has_writingprogram()) {
+        cout << "writingprogram: " << hb.writingprogram() << endl;
+    }
+    if (hb.has_source()) {
+        cout << "source: " << hb.source() << endl;
+    }
+}
+
+bool HasDenseNodes(const OSMPBF::HeaderBlock& hb) {
+    int n = hb.required_features_size();
+    for (int i = 0; i < n; ++i) {
+        if (hb.required_features(i) == "DenseNodes") {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ParseBlockBbox(const RawBlock& raw, OSMPBF::HeaderBBox* bbox) {
+    // required fields make a parse of some other kind of index data fail
+    return !raw.index_data.empty() && bbox->ParseFromString(raw.index_data);
+}
+
+const int kBlobRawField = 1;
+const int kBlobRawSizeField = 2;
+const int kBlobZlibDataField = 3;
+const int kBlobLz4DataField = 6;
+const int kBlobZstdDataField = 7;
+
+bool ParseBlobView(const uint8_t* data, int size, BlobView* view) {
+    *view = BlobView();
+    CodedInputStream input(data, size);
+    while (uint32_t tag = input.ReadTag()) {
+        int field = WireFormatLite::GetTagFieldNumber(tag);
+        WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+        if (wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED &&
+                (field == kBlobRawField || field == kBlobZlibDataField || field == kBlobLz4DataField || field == kBlobZstdDataField)) {
+            uint32_t length;
+            if (!input.ReadVarint32(&length)) return false;
+            view->data = data + input.CurrentPosition();
+            view->length = length;
+            if (!input.Skip(length)) return false;
+            if (field == kBlobRawField) {
+                view->compression = Compression::kRaw;
+            } else if (field == kBlobZlibDataField) {
+                view->compression = Compression::kZlib;
+            } else if (field == kBlobLz4DataField) {
+                view->compression = Compression::kLz4;
+            } else {
+                view->compression = Compression::kZstd;
+            }
+        } else if (wire_type == WireFormatLite::WIRETYPE_VARINT && field == kBlobRawSizeField) {
+            uint32_t raw_size;
+            if (!input.ReadVarint32(&raw_size)) return false;
+            view->raw_size = int(raw_size);
+        } else if (!WireFormatLite::SkipField(&input, tag)) {
+            return false;
+        }
+    }
+    return input.ConsumedEntireMessage();
+}
+
+void BlobDecoder::ResetArena() {
+    header_block = nullptr;
+    primitive_block = nullptr;
+    if (arena) {
+        size_t allocated = arena->SpaceAllocated();
+        if (allocated <= arena_block.size()) {
+            arena->Reset();
+            return;
+        }
+        // the last blob did not fit into the first block, grow it
+        arena.reset();
+        arena_block.resize(allocated + allocated / 4);
+    }
+    google::protobuf::ArenaOptions options;
+    options.initial_block = arena_block.data();
+    options.initial_block_size = arena_block.size();
+    arena.reset(new google::protobuf::Arena(options));
+}
+
+bool BlobDecoder::Decode(const RawBlock& raw) {
+    ResetArena();
+    if (raw.type != kOSMHeader && raw.type != kOSMData) {
+        return true;
+    }
+    const uint8_t* data;
+    size_t size;
+    if (!Decompress(raw, &data, &size)) {
+        return false;
+    }
+    if (raw.type == kOSMHeader) {
+        header_block = google::protobuf::Arena::CreateMessage<OSMPBF::HeaderBlock>(arena.get());
+        if (!header_block->ParseFromArray(data, int(size))) {
+            cerr << "failed to parse HeaderBlock" << endl;
+            return false;
+        }
+    } else {
+        primitive_block = google::protobuf::Arena::CreateMessage<OSMPBF::PrimitiveBlock>(arena.get());
+        if (!primitive_block->ParseFromArray(data, int(size))) {
+            cerr << "failed to parse PrimitiveBlock" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlobDecoder::Decompress(const RawBlock& raw, const uint8_t** data, size_t* size) {
+    BlobView blob;
+    if (!ParseBlobView(raw.Data(), raw.size, &blob)) {
+        cerr << "failed to parse blob" << endl;
+        return false;
+    }
+    if (!blob.data) {
+        cerr << "Blob has neither raw nor zlib, lz4 or zstd data" << endl;
+        return false;
+    }
+    if (blob.compression == Compression::kRaw) {
+        // nothing to do, point right into the blob
+        *data = blob.data;
+        *size = blob.length;
+        return true;
+    }
+    int64_t decompressed_size = ::Decompress(blob.compression, blob.data, blob.length, blob.raw_size, &decompressed);
+    if (decompressed_size < 0) {
+        return false;
+    }
+    *data = decompressed.data();
+    *size = size_t(decompressed_size);
+    return true;
+}
+
+bool FileBlockReader::ReadBlobHeaderSize() {
+    uint32_t blob_header_length;
+    if (mode == ReadMode::kMapped) {
+        if (offset + sizeof(blob_header_length) > mapped_file->Size()) {
+            reached_end = offset == mapped_file->Size();
+            return false;
+        }
+        memcpy(&blob_header_length, mapped_file->Data() + offset, sizeof(blob_header_length));
+        offset += sizeof(blob_header_length);
+        blob_header_size = (int) ntohl(blob_header_length);
+        return true;
+    }
+    binary_stream.read((char*) (&blob_header_length), sizeof(blob_header_length));
+    if (!binary_stream) {
+        // cerr << "only " << binary_stream.gcount() << " bytes are read" << endl;
+        reached_end = binary_stream.eof() && binary_stream.gcount() == 0;
+        return false;
+    }
+    blob_header_size = (int) ntohl(blob_header_length);
+    return true;
+}
+
+bool FileBlockReader::ReadBlobHeader() {
+    bool parsed;
+    if (mode == ReadMode::kMapped) {
+        if (blob_header_size < 0 || offset + blob_header_size > mapped_file->Size()) {
+            cerr << "truncated BlobHeader" << endl;
+            return false;
+        }
+        CodedInputStream coded_stream(mapped_file->Data() + offset, blob_header_size);
+        parsed = blob_header.ParseFromCodedStream(&coded_stream);
+        offset += blob_header_size;
+    } else {
+        stream_buffer->Read(blob_header_size);
+        parsed = stream_buffer->ParseMessage(blob_header);
+    }
+    if (!parsed) {
+        cerr << "failed to parse BlobHeader" << endl;
+        return false;
+    }
+    if (!blob_header.has_type()) {
+        cerr << "missing type in BlobHeader" << endl;
+        return false;
+    }
+    block_type = blob_header.type();
+    blob_size = blob_header.datasize();
+    return true;
+}
+
+bool FileBlockReader::ReadBlobData(RawBlock* raw) {
+    raw->size = blob_size;
+    if (mode == ReadMode::kMapped) {
+        if (blob_size < 0 || offset + blob_size > mapped_file->Size()) {
+            cerr << "truncated blob" << endl;
+            return false;
+        }
+        raw->mapped = mapped_file->Data() + offset;
+        raw->buffer.clear();
+        offset += blob_size;
+        return true;
+    }
+    raw->mapped = nullptr;
+    raw->buffer.resize(blob_size);
+    binary_stream.read(&raw->buffer[0], blob_size);
+    if (!binary_stream) {
+        cerr << "failed to read blob" << endl;
+        return false;
+    }
+    return true;
+}
+
+FileBlockReader::FileBlockReader(const string& data_path, ReadMode mode) : mode(mode) {
+    if (mode == ReadMode::kMapped) {
+        mapped_file = make_shared<MappedFile>(data_path);
+        valid = mapped_file->IsValid();
+        mapped_file->AdviseSequential();
+        return;
+    }
+    binary_stream = ifstream(data_path.c_str(), ios::binary);
+    valid = binary_stream.is_open();
+    if (!valid) {
+        cerr << "failed to open " << data_path << endl;
+    }
+    stream_buffer = make_shared<StreamBuffer>(binary_stream);
+}
+
+bool FileBlockReader::ReadRawBlock(RawBlock* raw) {
+    if (!valid) {
+        // a read error, not an empty file
+        return false;
+    }
+    blob_header_size = 0;
+    block_type.clear();
+    blob_size = 0;
+    if (!ReadBlobHeaderSize()) return false;
+    if (!ReadBlobHeader()) return false;
+    raw->index = blocks_read;
+    raw->type = block_type;
+    raw->index_data = blob_header.indexdata();
+    if (!ReadBlobData(raw)) return false;
+    ++blocks_read;
+    return true;
+}
+
+bool FileBlockReader::ReadBlock() {
+    if (!ReadRawBlock(&raw_block)) return false;
+    return decoder.Decode(raw_block);
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <google/protobuf/arena.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include "osm_proto/fileformat.pb.h"
+#include "osm_proto/osmformat.pb.h"
+
+#include "compression.h"
+#include "mapped_file.h"
+
+using namespace std;
+using namespace google::protobuf::io;
+
+class StreamBuffer {
+    istream &stream;
+    uint8_t *buffer;
+    int buffer_size;
+
+public:
+    StreamBuffer(istream& stream) : stream(stream), buffer(nullptr), buffer_size(0) {}
+
+    ~StreamBuffer() {
+        Clear();
+    }
+
+    void Clear() {
+        if (buffer) {
+            delete[] buffer;
+            buffer = nullptr;
+            buffer_size = 0;
+        }
+    }
+
+    bool Read(int size) {
+        Clear();
+        buffer = new uint8_t[size];
+        buffer_size = size;
+        stream.read((char*) buffer, size);
+        return (bool) stream;
+    }
+
+    template<class T>
+    bool ParseMessage(T &message) {
+        CodedInputStream coded_stream(buffer, buffer_size);
+        if (!message.ParseFromCodedStream(&coded_stream)) {
+            cerr << "failed to parse message" << endl;
+            return false;
+        }
+        return true;
+    }
+};
+
+void PrintHeaderBlock(const OSMPBF::HeaderBlock& hb);
+
+bool HasDenseNodes(const OSMPBF::HeaderBlock& hb);
+
+extern const string kOSMHeader;
+extern const string kOSMData;
+
+/* A blob as it is stored in the file: still serialized and compressed.
+ * The bytes either point into the file mapping or are owned by |buffer|. */
+struct RawBlock {
+    int64_t index = 0;
+    string type;
+    // indexdata of the BlobHeader, if any
+    string index_data;
+    const uint8_t* mapped = nullptr;
+    int size = 0;
+    string buffer;
+
+    const uint8_t* Data() const {
+        return mapped ? mapped : (const uint8_t*) buffer.data();
+    }
+};
+
+/* Reads the bbox of a blob from its index data, as FileBlockWriter puts it
+ * there. Returns false if the blob has none. */
+bool ParseBlockBbox(const RawBlock& raw, OSMPBF::HeaderBBox* bbox);
+
+/* Fields of a serialized Blob message, pointing into its bytes. */
+struct BlobView {
+    int raw_size = 0;
+    Compression compression = Compression::kRaw;
+    // null if the Blob has no payload in any supported encoding
+    const uint8_t* data = nullptr;
+    int length = 0;
+};
+
+/* Walks the Blob message in place, so that the payload is not copied into
+ * a string the way OSMPBF::Blob parsing would do. */
+bool ParseBlobView(const uint8_t* data, int size, BlobView* view);
+
+/* Inflates and parses blobs. Messages are created on an arena that is
+ * reset for every blob. The first block of the arena belongs to the decoder
+ * and grows to fit the largest blob seen, so once it has, parsing does not
+ * allocate at all. One decoder per thread. */
+class BlobDecoder {
+    vector<char> arena_block;
+    unique_ptr<google::protobuf::Arena> arena;
+    OSMPBF::HeaderBlock* header_block = nullptr;
+    OSMPBF::PrimitiveBlock* primitive_block = nullptr;
+    vector<uint8_t> decompressed;
+
+    void ResetArena();
+
+public:
+    /* Parses a header or data blob. The message is valid until the next
+     * call; the getter of the other kind returns an empty message. */
+    bool Decode(const RawBlock& raw);
+
+    /* Only decompresses the blob, for callers that decode the message by
+     * themselves. |data| stays valid until the next call, or points into
+     * |raw| if the blob is not compressed. */
+    bool Decompress(const RawBlock& raw, const uint8_t** data, size_t* size);
+
+    const OSMPBF::HeaderBlock& GetHeaderBlock() const {
+        return header_block ? *header_block : OSMPBF::HeaderBlock::default_instance();
+    }
+
+    const OSMPBF::PrimitiveBlock& GetPrimitiveBlock() const {
+        return primitive_block ? *primitive_block : OSMPBF::PrimitiveBlock::default_instance();
+    }
+};
+
+enum class ReadMode {
+    kStream,
+    kMapped,
+};
+
+class FileBlockReader {
+    ReadMode mode;
+    ifstream binary_stream;
+    shared_ptr<StreamBuffer> stream_buffer;
+    shared_ptr<MappedFile> mapped_file;
+    size_t offset = 0;
+    int blob_header_size;
+    OSMPBF::BlobHeader blob_header;
+    string block_type;
+    int blob_size;
+    int64_t blocks_read = 0;
+    // false if the file could not be opened
+    bool valid = true;
+    bool reached_end = false;
+    RawBlock raw_block;
+    BlobDecoder decoder;
+
+    bool ReadBlobHeaderSize();
+
+    bool ReadBlobHeader();
+
+    bool ReadBlobData(RawBlock* raw);
+
+public:
+    /* In the mapped mode blobs are handed out as pointers into the mapping,
+     * so the reader has to outlive the blocks it returns. */
+    FileBlockReader(const string& data_path, ReadMode mode = ReadMode::kMapped);
+
+    /* Reads the next blob without inflating it, so that decoding can be
+     * done elsewhere. */
+    bool ReadRawBlock(RawBlock* raw);
+
+    bool ReadBlock();
+
+    /* False if the file could not be opened or mapped, every read fails
+     * then. */
+    bool IsValid() const {
+        return valid;
+    }
+
+    /* Tells a clean end of file apart from a read error once ReadRawBlock
+     * or ReadBlock has returned false. */
+    bool ReachedEnd() const {
+        return reached_end;
+    }
+
+    string GetType() {
+        return block_type;
+    }
+
+    const OSMPBF::HeaderBlock& GetHeaderBlock() {
+        return decoder.GetHeaderBlock();
+    }
+
+    const OSMPBF::PrimitiveBlock& GetPrimitiveBlock() {
+        return decoder.GetPrimitiveBlock();
+    }
+};
@@ -0,0 +1,289 @@
+#include "pbf_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+
+#include "pbf_reader.h"
+
+FileBlockWriter::FileBlockWriter(const string& data_path, Compression compression) :
+    stream(data_path, ios::binary | ios::trunc),
+    compression(compression)
+{}
+
+bool FileBlockWriter::WriteBlob(const string& type, const string& index_data) {
+    OSMPBF::Blob blob;
+    if (compression == Compression::kRaw) {
+        blob.set_raw(serialized);
+    } else {
+        if (!Compress(compression, (const uint8_t*) serialized.data(), serialized.size(), &compressed)) {
+            return false;
+        }
+        blob.set_raw_size(int32_t(serialized.size()));
+        if (compression == Compression::kZlib) {
+            blob.set_zlib_data(compressed);
+        } else if (compression == Compression::kLz4) {
+            blob.set_lz4_data(compressed);
+        } else {
+            blob.set_zstd_data(compressed);
+        }
+    }
+    string blob_data = blob.SerializeAsString();
+
+    OSMPBF::BlobHeader blob_header;
+    blob_header.set_type(type);
+    if (!index_data.empty()) {
+        blob_header.set_indexdata(index_data);
+    }
+    blob_header.set_datasize(int32_t(blob_data.size()));
+    string header_data = blob_header.SerializeAsString();
+
+    uint32_t header_length = htonl(uint32_t(header_data.size()));
+    stream.write((const char*) &header_length, sizeof(header_length));
+    stream.write(header_data.data(), header_data.size());
+    stream.write(blob_data.data(), blob_data.size());
+    ++blocks_written;
+    return (bool) stream;
+}
+
+bool FileBlockWriter::WriteHeaderBlock(const OSMPBF::HeaderBlock& block) {
+    serialized.clear();
+    block.SerializeToString(&serialized);
+    return WriteBlob(kOSMHeader, string());
+}
+
+bool FileBlockWriter::WritePrimitiveBlock(const OSMPBF::PrimitiveBlock& block, const OSMPBF::HeaderBBox& bbox) {
+    serialized.clear();
+    block.SerializeToString(&serialized);
+    return WriteBlob(kOSMData, bbox.SerializeAsString());
+}
+
+bool FileBlockWriter::Close() {
+    stream.close();
+    return !stream.fail();
+}
+
+/* Interleaves the bits of the coordinates, shifted to be non-negative. */
+uint64_t ZOrderKey(int64_t lat, int64_t lon) {
+    auto spread = [](uint64_t x) {
+        x = (x | (x << 16)) & 0x0000FFFF0000FFFFull;
+        x = (x | (x << 8)) & 0x00FF00FF00FF00FFull;
+        x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0Full;
+        x = (x | (x << 2)) & 0x3333333333333333ull;
+        x = (x | (x << 1)) & 0x5555555555555555ull;
+        return x;
+    };
+    return (spread(uint32_t(lat + 900000000)) << 1) | spread(uint32_t(lon + 1800000000));
+}
+
+/* In model units, 1e-7 degrees. */
+struct BlockBounds {
+    int64_t south = numeric_limits<int64_t>::max();
+    int64_t west = numeric_limits<int64_t>::max();
+    int64_t north = numeric_limits<int64_t>::min();
+    int64_t east = numeric_limits<int64_t>::min();
+
+    void Add(int64_t lat, int64_t lon) {
+        south = min(south, lat);
+        north = max(north, lat);
+        west = min(west, lon);
+        east = max(east, lon);
+    }
+
+    void Add(const BlockBounds& other) {
+        south = min(south, other.south);
+        north = max(north, other.north);
+        west = min(west, other.west);
+        east = max(east, other.east);
+    }
+
+    bool Empty() const {
+        return south > north;
+    }
+
+    // HeaderBBox is in nanodegrees
+    OSMPBF::HeaderBBox ToHeaderBBox() const {
+        OSMPBF::HeaderBBox bbox;
+        bbox.set_left(west * 100);
+        bbox.set_right(east * 100);
+        bbox.set_top(north * 100);
+        bbox.set_bottom(south * 100);
+        return bbox;
+    }
+};
+
+/* Indices into the string table of one block by dictionary ID, 0 is the
+ * empty string. */
+class StringTableBuilder {
+    OSMPBF::StringTable* table;
+    const StringDictionary& dictionary;
+    vector<uint32_t> indices;
+
+public:
+    StringTableBuilder(OSMPBF::StringTable* table, const StringDictionary& dictionary) :
+        table(table),
+        dictionary(dictionary),
+        indices(dictionary.Size(), 0)
+    {
+        table->add_s("");
+    }
+
+    uint32_t Add(uint32_t id) {
+        if (!indices[id]) {
+            indices[id] = uint32_t(table->s_size());
+            table->add_s(*dictionary.Get(id));
+        }
+        return indices[id];
+    }
+};
+
+template<class T>
+bool ByKey(const pair<uint64_t, T>& a, const pair<uint64_t, T>& b) {
+    return a.first < b.first;
+}
+
+struct NodeEntry {
+    int64_t id;
+    OsmModel::Point point;
+};
+
+bool ById(const pair<uint64_t, NodeEntry>& a, const pair<uint64_t, NodeEntry>& b) {
+    return a.second.id < b.second.id;
+}
+
+bool WriteNodeBlocks(vector<pair<uint64_t, NodeEntry>>& nodes, int block_size, FileBlockWriter& writer) {
+    sort(nodes.begin(), nodes.end(), ByKey<NodeEntry>);
+    for (size_t begin = 0; begin < nodes.size(); begin += block_size) {
+        size_t end = min(nodes.size(), begin + block_size);
+        // by ID within the block, for shorter deltas
+        sort(nodes.begin() + begin, nodes.begin() + end, ById);
+        OSMPBF::PrimitiveBlock block;
+        block.mutable_stringtable()->add_s("");
+        OSMPBF::DenseNodes* dense = block.add_primitivegroup()->mutable_dense();
+        BlockBounds bounds;
+        int64_t last_id = 0;
+        int64_t last_lat = 0;
+        int64_t last_lon = 0;
+        for (size_t i = begin; i < end; ++i) {
+            int64_t id = nodes[i].second.id;
+            const OsmModel::Point& point = nodes[i].second.point;
+            // the default granularity of 100 nanodegrees is the model unit
+            dense->add_id(id - last_id);
+            dense->add_lat(point.lat - last_lat);
+            dense->add_lon(point.lon - last_lon);
+            last_id = id;
+            last_lat = point.lat;
+            last_lon = point.lon;
+            bounds.Add(point.lat, point.lon);
+        }
+        if (!writer.WritePrimitiveBlock(block, bounds.ToHeaderBBox())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct WayEntry {
+    uint32_t way;
+    BlockBounds bounds;
+};
+
+bool WriteWayBlocks(const OsmData& osm_data, vector<pair<uint64_t, WayEntry>>& ways, int block_size, FileBlockWriter& writer) {
+    const OsmModel::WayStore& store = osm_data.grid.GetWays();
+    sort(ways.begin(), ways.end(), ByKey<WayEntry>);
+    for (size_t begin = 0; begin < ways.size(); begin += block_size) {
+        size_t end = min(ways.size(), begin + block_size);
+        sort(ways.begin() + begin, ways.begin() + end, [&](const pair<uint64_t, WayEntry>& a, const pair<uint64_t, WayEntry>& b) {
+            return store.GetId(a.second.way) < store.GetId(b.second.way);
+        });
+        OSMPBF::PrimitiveBlock block;
+        StringTableBuilder strings(block.mutable_stringtable(), osm_data.strings);
+        OSMPBF::PrimitiveGroup* group = block.add_primitivegroup();
+        BlockBounds bounds;
+        for (size_t i = begin; i < end; ++i) {
+            OsmModel::WayView way = store.Get(ways[i].second.way);
+            OSMPBF::Way* output = group->add_ways();
+            output->set_id(way.GetId());
+            for (const OsmModel::Tag& tag : way.GetTags()) {
+                output->add_keys(strings.Add(tag.key));
+                output->add_vals(strings.Add(tag.value));
+            }
+            int64_t last_ref = 0;
+            for (int64_t ref : way.GetNodeIds()) {
+                output->add_refs(ref - last_ref);
+                last_ref = ref;
+            }
+            bounds.Add(ways[i].second.bounds);
+        }
+        if (!writer.WritePrimitiveBlock(block, bounds.ToHeaderBBox())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool WritePbfFile(const OsmData& osm_data, const string& data_path, const PbfWriteOptions& options) {
+    auto start_time = chrono::steady_clock::now();
+    const OsmModel::WayStore& store = osm_data.grid.GetWays();
+    vector<pair<uint64_t, NodeEntry>> nodes;
+    vector<pair<uint64_t, WayEntry>> ways;
+    BlockBounds file_bounds;
+    for (uint32_t i = 0; i < store.Size(); ++i) {
+        WayEntry entry = {i, BlockBounds()};
+        auto point = store.GetPoints(i).begin();
+        for (int64_t id : store.GetNodeIds(i)) {
+            nodes.emplace_back(ZOrderKey(point->lat, point->lon), NodeEntry{id, *point});
+            entry.bounds.Add(point->lat, point->lon);
+            ++point;
+        }
+        uint64_t key = 0;
+        if (!entry.bounds.Empty()) {
+            file_bounds.Add(entry.bounds);
+            key = ZOrderKey((entry.bounds.south + entry.bounds.north) / 2, (entry.bounds.west + entry.bounds.east) / 2);
+        }
+        ways.emplace_back(key, entry);
+    }
+    // every way has its own copy of the nodes it shares with others
+    sort(nodes.begin(), nodes.end(), ById);
+    nodes.erase(unique(nodes.begin(), nodes.end(), [](const pair<uint64_t, NodeEntry>& a, const pair<uint64_t, NodeEntry>& b) {
+        return a.second.id == b.second.id;
+    }), nodes.end());
+
+    OSMPBF::HeaderBlock header;
+    if (!file_bounds.Empty()) {
+        *header.mutable_bbox() = file_bounds.ToHeaderBBox();
+    }
+    header.add_required_features("OsmSchema-V0.6");
+    header.add_required_features("DenseNodes");
+    header.set_writingprogram("riddimdim");
+
+    // write aside and rename, the server watches its data file
+    string tmp_path = data_path + ".tmp";
+    FileBlockWriter writer(tmp_path, options.compression);
+    if (!writer.IsOpen()) {
+        cerr << "failed to open " << tmp_path << " for writing" << endl;
+        return false;
+    }
+    int block_size = max(1, options.block_size);
+    if (!writer.WriteHeaderBlock(header) ||
+            !WriteNodeBlocks(nodes, block_size, writer) ||
+            !WriteWayBlocks(osm_data, ways, block_size, writer) ||
+            !writer.Close()) {
+        cerr << "failed to write " << tmp_path << endl;
+        return false;
+    }
+    if (rename(tmp_path.c_str(), data_path.c_str()) != 0) {
+        cerr << "failed to rename " << tmp_path << " to " << data_path << endl;
+        return false;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "PBF file of state " << osm_data.state << " is written to " << data_path << " in "
+         << elapsed.count() << " ms: " << nodes.size() << " nodes and " << ways.size() << " ways in "
+         << writer.BlocksWritten() << " " << CompressionName(options.compression) << " blocks" << endl;
+    return true;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "osm_proto/fileformat.pb.h"
+#include "osm_proto/osmformat.pb.h"
+
+#include "compression.h"
+#include "loader.h"
+
+using namespace std;
+
+/* Writes blobs the way FileBlockReader reads them: a length-prefixed
+ * BlobHeader followed by a Blob with the compressed message. */
+class FileBlockWriter {
+    ofstream stream;
+    Compression compression;
+    string serialized;
+    string compressed;
+    int64_t blocks_written = 0;
+
+    bool WriteBlob(const string& type, const string& index_data);
+
+public:
+    FileBlockWriter(const string& data_path, Compression compression);
+
+    bool IsOpen() const {
+        return stream.is_open();
+    }
+
+    bool WriteHeaderBlock(const OSMPBF::HeaderBlock& block);
+
+    /* |bbox| goes into the indexdata of the BlobHeader, so that readers can
+     * skip the blob without inflating it, see ParseBlockBbox. */
+    bool WritePrimitiveBlock(const OSMPBF::PrimitiveBlock& block, const OSMPBF::HeaderBBox& bbox);
+
+    /* Flushes the file, returns false if any write has failed. */
+    bool Close();
+
+    int64_t BlocksWritten() const {
+        return blocks_written;
+    }
+};
+
+struct PbfWriteOptions {
+    Compression compression = Compression::kZlib;
+    // entities per block, the format recommends at most 8000
+    int block_size = 8000;
+};
+
+/* Writes the nodes and ways of |osm_data| as a PBF file: all nodes first,
+ * then all ways, as the loader resolves refs against the nodes read so
+ * far. Both are sorted along a Z-order curve and cut into blocks, so that
+ * every block covers a compact area given by its index bbox. Within a block
+ * the entities go by ID. Nodes are dense and carry only IDs and
+ * coordinates, ways only refs and tags. */
+bool WritePbfFile(const OsmData& osm_data, const string& data_path, const PbfWriteOptions& options = PbfWriteOptions());
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+/* Holds the current version of some data for concurrent readers. A reader
+ * takes a reference with Get and keeps using that version until it drops
+ * the reference, however many times the data is replaced meanwhile. The
+ * writer builds the next version off to the side and swaps it in with
+ * Publish. */
+template<class T>
+class Published {
+    mutable mutex mutex_;
+    shared_ptr<T> current_;
+
+public:
+    explicit Published(shared_ptr<T> initial = nullptr) : current_(move(initial)) {}
+
+    shared_ptr<T> Get() const {
+        lock_guard<mutex> lock(mutex_);
+        return current_;
+    }
+
+    /* Returns the replaced version. It is no longer reachable through Get,
+     * so once the caller holds the only reference nobody else can take
+     * one, see WaitUntilUnused. */
+    shared_ptr<T> Publish(shared_ptr<T> next) {
+        lock_guard<mutex> lock(mutex_);
+        swap(current_, next);
+        return next;
+    }
+};
+
+/* Waits for readers of a retired version to finish, so that it is freed by
+ * the calling thread rather than by whichever request happens to drop the
+ * last reference. */
+template<class T>
+void WaitUntilUnused(const shared_ptr<T>& retired) {
+    while (retired.use_count() > 1) {
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+}
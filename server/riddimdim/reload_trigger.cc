@@ -0,0 +1,93 @@
+#include "reload_trigger.h"
+
+#include <iostream>
+#include <map>
+#include <set>
+#include <thread>
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+void ReloadTrigger::Trigger(const string& reason) {
+    lock_guard<mutex> lock(mutex_);
+    pending_ = true;
+    last_trigger_ = chrono::steady_clock::now();
+    reason_ = reason;
+    changed_.notify_all();
+}
+
+string ReloadTrigger::Wait(chrono::seconds period, chrono::milliseconds debounce) {
+    unique_lock<mutex> lock(mutex_);
+    auto deadline = chrono::steady_clock::now() + period;
+    while (!pending_) {
+        if (changed_.wait_until(lock, deadline) == cv_status::timeout && !pending_) {
+            return "timer";
+        }
+    }
+    // every new trigger moves the end of the quiet period
+    while (chrono::steady_clock::now() < last_trigger_ + debounce) {
+        changed_.wait_until(lock, last_trigger_ + debounce);
+    }
+    pending_ = false;
+    return reason_;
+}
+
+void SplitPath(const string& path, string* directory, string* name) {
+    size_t slash = path.rfind('/');
+    if (slash == string::npos) {
+        *directory = ".";
+        *name = path;
+    } else {
+        *directory = slash ? path.substr(0, slash) : "/";
+        *name = path.substr(slash + 1);
+    }
+}
+
+bool WatchFiles(const vector<string>& paths, ReloadTrigger* trigger) {
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        cerr << "failed to init inotify" << endl;
+        return false;
+    }
+    map<string, set<string>> names_by_directory;
+    for (const string& path : paths) {
+        string directory, name;
+        SplitPath(path, &directory, &name);
+        names_by_directory[directory].insert(name);
+    }
+    map<int, set<string>> names_by_watch;
+    for (const auto& entry : names_by_directory) {
+        int watch = inotify_add_watch(fd, entry.first.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (watch < 0) {
+            // e.g. a changes directory that is not there yet, the rest is
+            // still worth watching
+            cerr << "failed to watch " << entry.first << ", changes of its files trigger no reload" << endl;
+            continue;
+        }
+        names_by_watch[watch] = entry.second;
+    }
+    if (names_by_watch.empty()) {
+        close(fd);
+        return false;
+    }
+    thread watcher([fd, names_by_watch, trigger]() {
+        alignas(inotify_event) char buffer[4096];
+        while (true) {
+            ssize_t length = read(fd, buffer, sizeof(buffer));
+            if (length <= 0) {
+                cerr << "failed to read inotify events, files are no longer watched" << endl;
+                close(fd);
+                return;
+            }
+            for (char* p = buffer; p < buffer + length; p += sizeof(inotify_event) + ((inotify_event*) p)->len) {
+                const inotify_event* event = (const inotify_event*) p;
+                auto it = names_by_watch.find(event->wd);
+                if (event->len && it != names_by_watch.end() && (it->second.count(event->name) || it->second.count(""))) {
+                    trigger->Trigger(string(event->name) + " changed");
+                }
+            }
+        }
+    });
+    watcher.detach();
+    return true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Wakes up the reload thread when data files change or a reload is
+ * requested, and otherwise once in a period. A burst of triggers is merged
+ * into one that fires only after things have been quiet for a while, so
+ * that a file is not read while it is still being written. */
+class ReloadTrigger {
+    mutex mutex_;
+    condition_variable changed_;
+    bool pending_ = false;
+    chrono::steady_clock::time_point last_trigger_;
+    string reason_;
+
+public:
+    void Trigger(const string& reason);
+
+    /* Blocks until there was a trigger followed by |debounce| of silence or
+     * until |period| passes. Returns what caused the wakeup. */
+    string Wait(chrono::seconds period, chrono::milliseconds debounce);
+};
+
+/* Watches |paths| with inotify from a background thread and triggers when
+ * one of them is written and closed or renamed into place. Directories are
+ * watched rather than the files, so that replaced files are followed. A
+ * path ending with a slash stands for any file in that directory. A
+ * directory that cannot be watched is skipped with a warning. Returns
+ * false if inotify is not available or nothing can be watched. */
+bool WatchFiles(const vector<string>& paths, ReloadTrigger* trigger);
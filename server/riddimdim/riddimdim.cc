@@ -1,401 +1,43 @@
-#include <fstream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <exception>
 #include <inttypes.h>
+#include <sstream>
 #include <iostream>
 #include <memory>
 #include <string>
 #include <thread>
-#include <unordered_map>
-
-#include <arpa/inet.h>
-#include <unistd.h>
-
-#include <google/protobuf/io/coded_stream.h>
-#include <google/protobuf/io/gzip_stream.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <utility>
+#include <vector>
 
 #include "httplib/httplib.h"
 #include "model/model.h"
 #include "nlohmann_json/include/nlohmann/json.hpp"
-#include "osm_proto/fileformat.pb.h"
-#include "osm_proto/osmformat.pb.h"
 
 #include "grid.h"
+#include "loader.h"
+#include "metrics.h"
+#include "osm_change.h"
+#include "published.h"
+#include "reload_trigger.h"
+#include "snapshot.h"
+#include "tag_keys.h"
+#include "thread_priority.h"
 
 using namespace std;
 using namespace httplib;
-using namespace google::protobuf::io;
 using json = nlohmann::json;
 
 const int kApiPort = 8082;
 const string kMapDataPath = "footways.pbf";
 const string kStatePath = "state.txt";
+const string kSnapshotPath = "footways.snapshot";
 const int kReloadPeriodSeconds = 15 * 60;
-
-bool StartsWith(const string& s, const string& prefix) {
-    size_t n = prefix.size();
-    if (s.size() < n)
-        return false;
-    for (size_t i = 0; i < n; ++i) {
-        if (s[i] != prefix[i])
-            return false;
-    }
-    return true;
-}
-
-class StreamBuffer {
-    istream &stream;
-    uint8_t *buffer;
-    int buffer_size;
-
-public:
-    StreamBuffer(istream& stream) : stream(stream), buffer(nullptr), buffer_size(0) {}
-
-    ~StreamBuffer() {
-        Clear();
-    }
-
-    void Clear() {
-        if (buffer) {
-            delete[] buffer;
-            buffer = nullptr;
-            buffer_size = 0;
-        }
-    }
-
-    bool Read(int size) {
-        Clear();
-        buffer = new uint8_t[size];
-        buffer_size = size;
-        stream.read((char*) buffer, size);
-        return (bool) stream;
-    }
-
-    template<class T>
-    bool ParseMessage(T &message) {
-        CodedInputStream coded_stream(buffer, buffer_size);
-        if (!message.ParseFromCodedStream(&coded_stream)) {
-            cerr << "failed to parse message" << endl;
-            return false;
-        }
-        return true;
-    }
-};
-
-struct ZlibBuffer {
-    const string& data;
-public:
-    ZlibBuffer(const string& d) : data(d) {}
-    template<class T>
-    bool ParseMessage(T &message) {
-        ArrayInputStream array_stream(data.data(), data.size());
-        GzipInputStream zlib_stream(&array_stream, GzipInputStream::Format::ZLIB);
-        if (!message.ParseFromZeroCopyStream(&zlib_stream)) {
-            cerr << "failed to parse message from zlib" << endl;
-            return false;
-        }
-        return true;
-    }
-};
-
-void PrintHeaderBlock(const OSMPBF::HeaderBlock& hb) {
-    if (hb.has_bbox()) {
-        cout << "has bbox" << endl;
-    }
-    int n = hb.required_features_size();
-    cout << n << " required_features" << endl;
-    for (int i = 0; i < n; ++i) {
-        cout << "  - " << hb.required_features(i) << endl;
-    }
-    n = hb.optional_features_size();
-    cout << n << "optional_features" << endl;
-    for (int i = 0; i < n; ++i) {
-        cout << "  - " << hb.optional_features(i) << endl;
-    }
-    if (hb.has_writingprogram()) {
-        cout << "writingprogram: " << hb.writingprogram() << endl;
-    }
-    if (hb.has_source()) {
-        cout << "source: " << hb.source() << endl;
-    }
-}
-
-bool HasDenseNodes(const OSMPBF::HeaderBlock& hb) {
-    int n = hb.required_features_size();
-    for (int i = 0; i < n; ++i) {
-        if (hb.required_features(i) == "DenseNodes") {
-            return true;
-        }
-    }
-    return false;
-}
-
-const string kOSMHeader = "OSMHeader";
-const string kOSMData = "OSMData";
-
-class FileBlockReader {
-    ifstream binary_stream;
-    int blob_header_size;
-    OSMPBF::BlobHeader blob_header;
-    shared_ptr<StreamBuffer> stream_buffer;
-    string block_type;
-    int blob_size;
-    OSMPBF::Blob blob;
-    OSMPBF::HeaderBlock header_block;
-    OSMPBF::PrimitiveBlock primitive_block;
-
-    bool ReadBlobHeaderSize() {
-        uint32_t blob_header_length;
-        binary_stream.read((char*) (&blob_header_length), sizeof(blob_header_length));
-        if (!binary_stream) {
-            // cerr << "only " << binary_stream.gcount() << " bytes are read" << endl;
-            return false;
-        }
-        blob_header_size = (int) ntohl(blob_header_length);
-        return true;
-    }
-
-    bool ReadBlobHeader() {
-        stream_buffer->Read(blob_header_size);
-        if (!stream_buffer->ParseMessage(blob_header)) {
-            cerr << "failed to parse BlobHeader" << endl;
-            return false;
-        }
-        if (!blob_header.has_type()) {
-            cerr << "missing type in BlobHeader" << endl;
-            return false;
-        }
-        block_type = blob_header.type();
-        blob_size = blob_header.datasize();
-        return true;
-    }
-
-    bool ParseBlob() {
-        const string& zlib_data = blob.zlib_data();
-        ZlibBuffer zbuffer(zlib_data);
-        if (block_type == kOSMHeader) {
-            if (!zbuffer.ParseMessage(header_block)) {
-                cerr << "failed to parse HeaderBlock" << endl;
-                return false;
-            }
-        } else if (block_type == kOSMData) {
-            if (!zbuffer.ParseMessage(primitive_block)) {
-                cerr << "failed to parse PrimitiveBlock" << endl;
-                return false;
-            }
-        }
-        return true;
-    }
-
-    bool ReadBlob() {
-        stream_buffer->Read(blob_size);
-        if (!stream_buffer->ParseMessage(blob)) {
-            cerr << "failed to parse blob" << endl;
-            return false;
-        }
-        if (!blob.has_zlib_data()) {
-            cerr << "missing zlib_data in Blob" << endl;
-            return false;
-        }
-        return ParseBlob();
-    }
-public:
-    FileBlockReader(const string& data_path) {
-        binary_stream = ifstream(data_path.c_str(), ios::binary);
-        assert(binary_stream.is_open());
-        stream_buffer = make_shared<StreamBuffer>(binary_stream);
-    }
-
-    bool ReadBlock() {
-        blob_header_size = 0;
-        block_type.clear();
-        blob_size = 0;
-        if (!ReadBlobHeaderSize()) return false;
-        if (!ReadBlobHeader()) return false;
-        if (!ReadBlob()) return false;
-        return true;
-    }
-
-    string GetType() {
-        return block_type;
-    }
-
-    const OSMPBF::HeaderBlock& GetHeaderBlock() {
-        return header_block;
-    }
-
-    const OSMPBF::PrimitiveBlock& GetPrimitiveBlock() {
-        return primitive_block;
-    }
-};
-
-typedef unordered_map<int64_t, OsmModel::NodeHolder> NodesMap;
-typedef vector<shared_ptr<string>> StringTable;
-
-template<class T>
-vector<OsmModel::Tag> CollectTags(const T& message, const StringTable& stringtable, int offset) {
-    vector<OsmModel::Tag> result;
-    int tags_nr = message.keys_size();
-    for (int i = 0; i < tags_nr; ++i) {
-        int key_id = message.keys(i);
-        int val_id = message.vals(i);
-        result.push_back({stringtable[offset + key_id], stringtable[offset + val_id]});
-    }
-    return result;
-}
-
-OsmModel::WayHolder ReadWay(const OSMPBF::Way &way, const NodesMap& nodes_map, const StringTable& stringtable, int offset, bool *broken) {
-    int64_t id = way.id();
-    int refs_nr = way.refs_size();
-    vector<OsmModel::NodeHolder> node_collector;
-    int64_t ref = 0;
-    *broken = false;
-    bool started = false;
-    for (int i = 0; i < refs_nr; ++i) {
-        ref += way.refs(i);
-        if (!nodes_map.count(ref)) {
-            *broken = true;
-            // cerr << "Not found node #" << ref << " for way #" << id << ", skipping the way entirely"<< endl;
-            if (started) {
-                break;
-            } else {
-                continue;
-            }
-        }
-        started = true;
-        OsmModel::NodeHolder node = nodes_map.at(ref);
-        node_collector.push_back(node);
-    }
-    if (node_collector.empty()) {
-        return {};
-    }
-    vector<OsmModel::Tag> tags = CollectTags(way, stringtable, offset);
-    return make_shared<OsmModel::Way>(id, move(tags), move(node_collector));
-}
-
-OsmModel::NodeHolder ReadNode(const OSMPBF::Node &proto_node, const StringTable& stringtable, int offset) {
-    int64_t id = proto_node.id();
-    vector<OsmModel::Tag> tags = CollectTags(proto_node, stringtable, offset);
-    int64_t lat = proto_node.lat();
-    int64_t lon = proto_node.lon();
-    return make_shared<OsmModel::Node>(id, move(tags), lat, lon);
-}
-
-vector<OsmModel::NodeHolder> ReadDenseNodes(const OSMPBF::DenseNodes &proto_nodes) {
-    vector<OsmModel::NodeHolder> result;
-    int n = proto_nodes.id_size();
-    int64_t id = 0;
-    int64_t lat = 0;
-    int64_t lon = 0;
-    for (int i = 0; i < n; ++i) {
-        id += proto_nodes.id(i);
-        lat += proto_nodes.lat(i);
-        lon += proto_nodes.lon(i);
-        result.push_back(make_shared<OsmModel::Node>(id, vector<OsmModel::Tag>(), lat, lon));
-    }
-    return result;
-}
-
-int64_t ReadState(const string& state_path, string* timestamp = nullptr) {
-    ifstream state_reader(state_path);
-    assert(state_reader);
-    int64_t result;
-    state_reader >> result;
-    assert(result >= 1000000000);  // sanity check
-    if (timestamp) {
-        string line;
-        const static string kTimestampPrefix = "timestamp=";
-        while (state_reader >> line) {
-            if (StartsWith(line, kTimestampPrefix)) {
-                string t = line.substr(kTimestampPrefix.size());
-                string t2;
-                for (char c : t) {
-                    if (c == '\\') continue;
-                    t2.push_back(c);
-                }
-                *timestamp = t2;
-                break;
-            }
-        }
-    }
-    return result;
-}
-
-struct OsmData {
-    StringTable strings;
-    NodesMap nodes;
-    Grid<int64_t, int> grid;
-    int skipped_ways = 0;
-    int partial_ways = 0;
-    int64_t state = 0;
-    string timestamp;
-
-    OsmData(int cell_size) :
-        grid(cell_size)
-    {}
-};
-
-typedef shared_ptr<OsmData> OsmDataHolder;
-
-OsmDataHolder OpenPbfData2(const string& data_path, const string& state_path) {
-    cout << "Loading data from " << data_path << " and " << state_path << endl;
-    FileBlockReader reader(data_path);
-    OsmDataHolder osm_data = make_shared<OsmData>(1e4);
-    osm_data->state = ReadState(state_path, &(osm_data->timestamp));
-    if (!osm_data->timestamp.empty()) {
-        cout << "Timestamp: " << osm_data->timestamp << endl;
-    }
-    while (reader.ReadBlock()) {
-        if (reader.GetType() == kOSMData) {
-            const OSMPBF::PrimitiveBlock& block = reader.GetPrimitiveBlock();
-            const OSMPBF::StringTable& table = block.stringtable();
-            int m = table.s_size();
-            int stringTableOffset = osm_data->strings.size();
-            if (m) {
-                for (int i = 0; i < m; ++i) {
-                    osm_data->strings.push_back(make_shared<string>(table.s(i)));
-                }
-            }
-            int n = block.primitivegroup_size();
-            // cout << "Found OSMData: " << n << " group(s)" << endl;
-            for (int i = 0; i < n; ++i) {
-                const OSMPBF::PrimitiveGroup& group = block.primitivegroup(i);
-                if (group.has_dense()) {
-                    // cout << "  - dense nodes: " << group.dense().id_size() << endl;
-                    vector<shared_ptr<OsmModel::Node>> nodes = ReadDenseNodes(group.dense());
-                    for (auto ptr : nodes) {
-                        osm_data->nodes[ptr->GetId()] = ptr;
-                    }
-                }
-                // cout << "  - nodes: " << group.nodes_size() << ", ways: " << group.ways_size() << ", relations: " << group.relations_size() << endl;
-                if (group.nodes_size()) {
-                    cerr << "Parsing of regular nodes is not supported yet. Abort." << endl;
-                    exit(1);
-                }
-                for (int j = 0; j < group.ways_size(); ++j) {
-                    bool broken = false;
-                    OsmModel::WayHolder way = ReadWay(group.ways(j), osm_data->nodes, osm_data->strings, stringTableOffset, &broken);
-                    if (!way) {
-                        ++osm_data->skipped_ways;
-                        continue;
-                    }
-                    if (broken) {
-                        ++osm_data->partial_ways;
-                    }
-                    osm_data->grid.AddWay(way);
-                }
-            }
-        } else {
-            // cout << reader.GetType() << endl;
-        }
-    }
-    cout << "State " << osm_data->state << ":" << endl;
-    cout << "  Total number of strings: " << osm_data->strings.size() << endl;
-    cout << "  Total number of nodes: " << osm_data->nodes.size() << endl;
-    cout << "  Total number of ways: " << osm_data->grid.CountWays() << endl;
-    cout << "  Number of skipped ways: " << osm_data->skipped_ways << endl;
-    cout << "  Number of partial ways: " << osm_data->partial_ways << endl;
-    return osm_data;
-}
+// quiet time after the last change of the data files before they are read
+const int kReloadDebounceMs = 2000;
 
 vector<Bbox<int64_t>> ReadBboxes(const Request& req) {
     vector<Bbox<int64_t>> result;
@@ -440,55 +82,304 @@ RequestParams ReadParams(const Request& req) {
     return params;
 }
 
-json ToJson(const OsmModel::NodeHolder& node) {
-    return {node->GetLat() / 1e7, node->GetLon() / 1e7};
+json ToJson(const OsmModel::Point& point) {
+    return {point.lat / 1e7, point.lon / 1e7};
 }
 
-json ToJson(const OsmModel::WayHolder& way, bool full=false) {
+json ToJson(const OsmModel::WayView& way, const StringDictionary& strings, bool full=false) {
     json result;
     if (full) {
-        result["id"] = way->GetId();
+        result["id"] = way.GetId();
     }
-    if (way->CountNodes()) {
+    if (way.CountNodes()) {
         json nodes = json::array();
-        for (const OsmModel::NodeHolder& node : *way) {
-            nodes.push_back(ToJson(node));
+        for (const OsmModel::Point& point : way.GetPoints()) {
+            nodes.push_back(ToJson(point));
         }
         result["nodes"] = nodes;
     }
-    const vector<OsmModel::Tag>& tags = way->GetTags();
-    if (!tags.empty()) {
-        json obj;
-        /* TODO strip unsupported tags if !full */
-        for (const OsmModel::Tag& tag : tags) {
-            obj[*tag.key] = *tag.value;
+    // the client only uses the known keys, the rest is only sent if full
+    json obj;
+    for (const OsmModel::Tag& tag : way.GetTags()) {
+        if (IsKnownKey(tag.key)) {
+            obj[kTagKeyNames[tag.key]] = *strings.Get(tag.value);
+        } else if (full) {
+            obj[*strings.Get(tag.key)] = *strings.Get(tag.value);
         }
+    }
+    if (!obj.is_null()) {
         result["tags"] = obj;
     }
     return result;
 }
 
-json ToJson(const OsmModel::WayContainer& ways, bool full=false) {
-    json result;
-    for (const OsmModel::WayHolder &way : ways) {
-        result[to_string(way->GetId())] = ToJson(way, full);
+/* Adds |ways| to |result| by ID, tags are looked up in |strings| of the
+ * data they are from. */
+void AddWaysJson(const OsmModel::WayContainer& ways, const StringDictionary& strings, bool full, json* result) {
+    for (const OsmModel::WayView& way : ways) {
+        (*result)[to_string(way.GetId())] = ToJson(way, strings, full);
+    }
+}
+
+struct ServerOptions {
+    // run reloads with SCHED_IDLE, so that they use only CPU time requests leave
+    bool background_reload = true;
+    // CPUs reloads are pinned to, any if empty
+    vector<int> reload_cpus;
+    LoadOptions reload_options;
+};
+
+/* A part of the dataset with files and reloads of its own, e.g. one city.
+ * While a shard reloads, the others keep serving and reloading as usual. */
+struct Shard {
+    string name;
+    // the regions the footways are cut from, or the prepared file if none
+    vector<PbfInput> regions;
+    string data_path;
+    string state_path;
+    string snapshot_path;
+    // replication diffs applied between full reloads, none if empty
+    string changes_dir;
+    WayFilter changes_filter = {kFootwayTags, {}};
+    // null until the first load is over
+    Published<OsmData> data;
+    LoadProgress progress;
+    ReloadTrigger reload_trigger;
+
+    OsmDataHolder Open(const LoadOptions& options, const OsmData* previous) const {
+        if (!regions.empty()) {
+            return OpenData(regions, state_path, snapshot_path, options);
+        }
+        return OpenData(data_path, state_path, snapshot_path, options, previous);
+    }
+
+    /* Whether the shard is to answer for any of |bboxes| once it is loaded,
+     * judging by the bboxes of its regions alone. */
+    bool MayCover(const vector<Bbox<int64_t>>& bboxes) const {
+        for (const PbfInput& region : regions) {
+            if (region.filter.bboxes.empty()) {
+                return true;
+            }
+        }
+        if (regions.empty()) {
+            return true;
+        }
+        for (const PbfInput& region : regions) {
+            for (const Bbox<int64_t>& area : region.filter.bboxes) {
+                for (const Bbox<int64_t>& bbox : bboxes) {
+                    if (bbox.west_ <= area.east_ && area.west_ <= bbox.east_ && bbox.south_ <= area.north_ && area.south_ <= bbox.north_) {
+                        return true;
+                    }
+                }
+            }
+        }
+        return false;
     }
-    return {
-        {"ways", result}
-    };
+
+    vector<string> WatchedPaths() const {
+        vector<string> paths = {state_path};
+        if (regions.empty()) {
+            paths.push_back(data_path);
+        }
+        for (const PbfInput& region : regions) {
+            paths.push_back(region.path);
+        }
+        if (!changes_dir.empty()) {
+            paths.push_back(changes_dir + "/");
+        }
+        return paths;
+    }
+};
+
+typedef vector<unique_ptr<Shard>> Shards;
+
+// statuses /ways answers with, anything else is counted as "other"
+const vector<string> kWaysStatuses = {"200", "400", "503", "other"};
+
+/* Serving latency split by the status of the response and by whether a
+ * reload was running, to see what the reloads cost. */
+struct ServingMetrics {
+    // number of shards reloading
+    atomic<int> reloading;
+    atomic<uint64_t> reloads;
+    atomic<uint64_t> last_reload_ms;
+    LatencyHistogram ways_latency[4][2];
+
+    ServingMetrics() : reloading(0), reloads(0), last_reload_ms(0) {}
+
+    void RecordWays(int status, bool was_reloading, double seconds) {
+        size_t i = 0;
+        while (i + 1 < kWaysStatuses.size() && kWaysStatuses[i] != to_string(status)) {
+            ++i;
+        }
+        ways_latency[i][was_reloading].Record(seconds);
+    }
+};
+
+/* Records the latency of a /ways request with the status it ends with,
+ * whichever way the handler returns. */
+class WaysLatencyRecorder {
+public:
+    WaysLatencyRecorder(ServingMetrics& metrics, const Response& res)
+        : metrics_(metrics), res_(res), start_time_(chrono::steady_clock::now()),
+          reloading_(metrics.reloading > 0) {}
+
+    ~WaysLatencyRecorder() {
+        bool reloading = reloading_ || metrics_.reloading > 0;
+        metrics_.RecordWays(res_.status, reloading,
+            chrono::duration<double>(chrono::steady_clock::now() - start_time_).count());
+    }
+
+private:
+    ServingMetrics& metrics_;
+    const Response& res_;
+    chrono::steady_clock::time_point start_time_;
+    bool reloading_;
+};
+
+string FormatMetrics(const ServingMetrics& metrics, const Shards& shards) {
+    stringstream out;
+    out << "# TYPE riddimdim_ways_latency_seconds histogram\n";
+    for (size_t status = 0; status < kWaysStatuses.size(); ++status) {
+        for (int reloading = 0; reloading < 2; ++reloading) {
+            string labels = "status=\"" + kWaysStatuses[status] + "\",reload=\"" + to_string(reloading) + "\"";
+            metrics.ways_latency[status][reloading].Write("riddimdim_ways_latency_seconds", labels, out);
+        }
+    }
+    out << "# TYPE riddimdim_ways_latency_quantile_seconds gauge\n";
+    for (size_t status = 0; status < kWaysStatuses.size(); ++status) {
+        for (int reloading = 0; reloading < 2; ++reloading) {
+            for (double q : {0.5, 0.99}) {
+                out << "riddimdim_ways_latency_quantile_seconds{status=\"" << kWaysStatuses[status] << "\",reload=\""
+                    << reloading << "\",quantile=\"" << q << "\"} "
+                    << metrics.ways_latency[status][reloading].Quantile(q) << "\n";
+            }
+        }
+    }
+    out << "# TYPE riddimdim_reload_in_progress gauge\n";
+    out << "riddimdim_reload_in_progress " << metrics.reloading << "\n";
+    out << "# TYPE riddimdim_reloads_total counter\n";
+    out << "riddimdim_reloads_total " << metrics.reloads << "\n";
+    out << "# TYPE riddimdim_last_reload_seconds gauge\n";
+    out << "riddimdim_last_reload_seconds " << metrics.last_reload_ms / 1e3 << "\n";
+    out << "# TYPE riddimdim_data_state gauge\n";
+    for (const unique_ptr<Shard>& shard : shards) {
+        OsmDataHolder data = shard->data.Get();
+        out << "riddimdim_data_state{shard=\"" << shard->name << "\"} " << (data ? data->state : 0) << "\n";
+    }
+    out << "# TYPE riddimdim_data_sequence gauge\n";
+    for (const unique_ptr<Shard>& shard : shards) {
+        OsmDataHolder data = shard->data.Get();
+        out << "riddimdim_data_sequence{shard=\"" << shard->name << "\"} " << (data ? data->sequence : 0) << "\n";
+    }
+    return out.str();
 }
 
-int StartServer(const string& data_path, const string& state_path) {
-    OsmDataHolder data = OpenPbfData2(data_path, state_path);
-    cout << "Using data of state " << data->state << endl;
+/* Same as Shard::Open, but a load that throws, e.g. runs out of memory,
+ * gives null instead of taking the server down. */
+OsmDataHolder TryOpen(const Shard& shard, const LoadOptions& options, const OsmData* previous) {
+    try {
+        return shard.Open(options, previous);
+    } catch (const exception& e) {
+        cerr << "[" << shard.name << "] failed to load data: " << e.what() << endl;
+        return nullptr;
+    }
+}
+
+/* Loads the shard with |initial_options| and then runs its reload loop,
+ * never returns. */
+void RunReloads(Shard& shard, const LoadOptions& initial_options, const ServerOptions& options, ServingMetrics& metrics) {
+    string prefix = "[" + shard.name + "] ";
+    // nothing is served from the shard until it is loaded, so the first load
+    // runs at the normal priority
+    LoadOptions load_options = initial_options;
+    load_options.progress = &shard.progress;
+    auto start_time = chrono::steady_clock::now();
+    while (true) {
+        // progress is of this attempt alone
+        shard.progress.bytes_read = 0;
+        shard.progress.bytes_total = 0;
+        OsmDataHolder first_data = TryOpen(shard, load_options, nullptr);
+        if (first_data && first_data->complete) {
+            shard.data.Publish(move(first_data));
+            break;
+        }
+        // partial data is never served, the shard stays loading and the load
+        // is retried on the next trigger, whether the state changes or not
+        if (first_data) {
+            cout << prefix << "Data of state " << first_data->state << " is incomplete, retrying on the next trigger" << endl;
+        } else {
+            cout << prefix << "No data is loaded, retrying on the next trigger" << endl;
+        }
+        first_data.reset();
+        string reason = shard.reload_trigger.Wait(chrono::seconds(kReloadPeriodSeconds), chrono::milliseconds(kReloadDebounceMs));
+        cout << prefix << "Trying to load again (" << reason << ")..." << endl;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << prefix << "Using data of state " << shard.data.Get()->state << ", ready in " << elapsed.count() << " ms" << endl;
+
+    // the loader threads started from here inherit both
+    if (options.background_reload) {
+        LowerThreadPriority();
+    }
+    SetThreadAffinity(options.reload_cpus);
+    while (true) {
+        string reason = shard.reload_trigger.Wait(chrono::seconds(kReloadPeriodSeconds), chrono::milliseconds(kReloadDebounceMs));
+        int64_t candidate = ReadState(shard.state_path);
+        int64_t current = shard.data.Get()->state;
+        if (!candidate) {
+            // e.g. caught between the removal and the rename of the file
+            cout << prefix << "No valid state (" << reason << "), still using state " << current << endl;
+        } else if (candidate > current) {
+            cout << prefix << "New state is found (" << reason << "). Trying to load..." << endl;
+            auto start_time = chrono::steady_clock::now();
+            ++metrics.reloading;
+            // requests keep being served from the current data meanwhile,
+            // and the next one shares whatever did not change with it
+            OsmDataHolder current_data = shard.data.Get();
+            OsmDataHolder next_data = TryOpen(shard, options.reload_options, current_data.get());
+            current_data.reset();
+            if (!next_data || !next_data->complete) {
+                --metrics.reloading;
+                cout << prefix << "Data of state " << candidate << " is incomplete, still using state " << current << endl;
+                continue;
+            }
+            int64_t next_state = next_data->state;
+            OsmDataHolder retired = shard.data.Publish(move(next_data));
+            cout << prefix << "Using data of state " << next_state << endl;
+            WaitUntilUnused(retired);
+            retired.reset();
+            cout << prefix << "Data of state " << current << " is released" << endl;
+            --metrics.reloading;
+            ++metrics.reloads;
+            metrics.last_reload_ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time).count();
+        } else if (reason != "timer") {
+            cout << prefix << "State " << current << " is still the latest (" << reason << ")" << endl;
+        }
+        if (!shard.changes_dir.empty()) {
+            OsmDataHolder current_data = shard.data.Get();
+            OsmDataHolder next_data = ApplyPendingChanges(current_data, shard.changes_dir, shard.changes_filter);
+            if (next_data != current_data) {
+                current_data.reset();
+                cout << prefix << "Using data of state " << next_data->state << " with changes up to " << next_data->sequence << endl;
+                OsmDataHolder retired = shard.data.Publish(move(next_data));
+                WaitUntilUnused(retired);
+            }
+        }
+    }
+}
 
+int StartServer(const Shards& shards, const ServerOptions& options) {
     Server svr;
     if (!svr.is_valid()) {
         cerr << "server has an error..." << endl;
         return -1;
     }
 
+    ServingMetrics metrics;
+
     svr.Post("/ways", [&](const Request& req, Response& res) {
+        WaysLatencyRecorder recorder(metrics, res);
         vector<Bbox<int64_t>> bboxes = ReadBboxes(req);
         if (bboxes.empty()) {
             res.status = 400;
@@ -496,53 +387,280 @@ int StartServer(const string& data_path, const string& state_path) {
             return;
         }
         RequestParams params = ReadParams(req);
-        if (!data) {
+        // keeps the versions in use alive until the response is ready, even
+        // if a reload publishes the next ones meanwhile
+        vector<OsmDataHolder> used_data;
+        json ways;
+        size_t ways_nr = 0;
+        string timestamp;
+        vector<string> loading;
+        for (const unique_ptr<Shard>& shard : shards) {
+            OsmDataHolder data = shard->data.Get();
+            if (!data) {
+                if (shard->MayCover(bboxes)) {
+                    loading.push_back(shard->name);
+                }
+                continue;
+            }
+            bool wanted = false;
+            for (const Bbox<int64_t>& bbox : bboxes) {
+                wanted = wanted || data->grid.Intersects(bbox);
+            }
+            if (!wanted) {
+                continue;
+            }
+            OsmModel::WayContainer shard_ways = data->grid.SelectWaysByBbox(bboxes);
+            AddWaysJson(shard_ways, data->strings, params.full, &ways);
+            ways_nr += shard_ways.size();
+            // the oldest of the shards the answer comes from
+            if (!data->timestamp.empty() && (timestamp.empty() || data->timestamp < timestamp)) {
+                timestamp = data->timestamp;
+            }
+            used_data.push_back(move(data));
+        }
+        if (!loading.empty()) {
+            // a partial answer would look like there are no footways there
+            json message = {
+                {"status", "error"},
+                {"loading", loading},
+            };
+            res.set_header("Retry-After", "5");
+            res.set_content(message.dump(), "application/json");
             res.status = 503;
-            cout << "/ways -> 503" << endl;
+            cout << "/ways -> 503: " << OsmModel::JoinStrings(loading, ", ") << " not loaded yet" << endl;
             return;
         }
-        OsmModel::WayContainer ways = data->grid.SelectWaysByBbox(bboxes);
         json message = {
             {"status", "success"},
             {"params", BboxesToString(bboxes)},
-            {"result", ToJson(ways, params.full)},
+            {"result", {{"ways", ways}}},
         };
-        if (!data->timestamp.empty()) {
-            message["data_timestamp"] = data->timestamp;
+        if (!timestamp.empty()) {
+            message["data_timestamp"] = timestamp;
         }
         res.set_header("Access-Control-Allow-Origin", "*");
         res.set_content(message.dump(), "application/json");
         res.status = 200;
-        cout << "/ways -> 200: found " << ways.size() << " ways" << endl;
+        cout << "/ways -> 200: found " << ways_nr << " ways" << endl;
     });
 
-    svr.set_error_handler([](const Request & /*req*/, Response &res) {
+    // ready once every shard is loaded, with the progress of the others
+    svr.Get("/ready", [&](const Request& /*req*/, Response& res) {
+        bool ready = true;
+        json shard_reports = json::object();
+        for (const unique_ptr<Shard>& shard : shards) {
+            OsmDataHolder data = shard->data.Get();
+            json report = {
+                {"ready", bool(data)},
+                {"progress", data ? 1.0 : shard->progress.Fraction()},
+            };
+            if (data) {
+                report["state"] = data->state;
+            }
+            shard_reports[shard->name] = report;
+            ready = ready && data;
+        }
         json message = {
-            {"status", "error"}
+            {"status", ready ? "success" : "loading"},
+            {"shards", shard_reports},
         };
         res.set_content(message.dump(), "application/json");
+        res.status = ready ? 200 : 503;
+    });
+
+    svr.Get("/metrics", [&](const Request& /*req*/, Response& res) {
+        res.set_content(FormatMetrics(metrics, shards), "text/plain; version=0.0.4");
+        res.status = 200;
     });
 
-    thread reload_data_thread([&]() {
-        while (true) {
-            sleep(kReloadPeriodSeconds);
-            int64_t candidate = ReadState(state_path);
-            assert(bool(data));
-            if (candidate > data->state) {
-                cout << "New state is found. Trying to load..." << endl;
-                data.reset();
-                OsmDataHolder next_data = OpenPbfData2(data_path, state_path);
-                data.swap(next_data);
-                cout << "Using data of state " << data->state << endl;
+    for (const unique_ptr<Shard>& shard : shards) {
+        if (!WatchFiles(shard->WatchedPaths(), &shard->reload_trigger)) {
+            cerr << "data files of " << shard->name << " are not watched, reloading every " << kReloadPeriodSeconds << " s only" << endl;
+        }
+        if (!shard->changes_dir.empty()) {
+            // for the changes that piled up while the server was down
+            shard->reload_trigger.Trigger("start");
+        }
+    }
+
+    // for the update script, which runs on the same host
+    svr.Post("/admin/reload", [&](const Request& req, Response& res) {
+        string remote = req.get_header_value("REMOTE_ADDR");
+        bool local = req.get_header_value_count("REMOTE_ADDR") == 1 && (remote == "127.0.0.1" || remote == "::1");
+        // requests coming through a reverse proxy are local too, but carry these
+        bool proxied = req.has_header("X-Forwarded-For") || req.has_header("X-Real-IP");
+        if (!local || proxied) {
+            res.status = 403;
+            cout << "/admin/reload -> 403" << endl;
+            return;
+        }
+        // ?shard=moscow reloads only that one
+        string name = req.get_param_value("shard");
+        for (const unique_ptr<Shard>& shard : shards) {
+            if (name.empty() || shard->name == name) {
+                shard->reload_trigger.Trigger("reload is requested");
             }
         }
+        json message = {
+            {"status", "success"},
+        };
+        res.set_content(message.dump(), "application/json");
+        res.status = 202;
+        cout << "/admin/reload -> 202" << endl;
     });
 
+    svr.set_error_handler([](const Request & /*req*/, Response &res) {
+        // keeps the details a handler has put in
+        if (!res.body.empty()) {
+            return;
+        }
+        json message = {
+            {"status", "error"}
+        };
+        res.set_content(message.dump(), "application/json");
+    });
+
+    // shards load in parallel and split the cores between them, requests
+    // are served from each one as soon as it is ready
+    LoadOptions initial_options;
+    initial_options.threads = max(1, int(thread::hardware_concurrency() / shards.size()));
+    vector<thread> reload_threads;
+    for (const unique_ptr<Shard>& shard : shards) {
+        Shard* s = shard.get();
+        reload_threads.emplace_back([s, &initial_options, &options, &metrics]() {
+            RunReloads(*s, initial_options, options, metrics);
+        });
+    }
+
     cout << "Server is listening on port " << kApiPort << endl;
     svr.listen("localhost", kApiPort);
     return 0;
 }
 
-int main() {
-    return StartServer(kMapDataPath, kStatePath);
+bool StartsWith(const char* s, const char* prefix) {
+    return strncmp(s, prefix, strlen(prefix)) == 0;
+}
+
+/* Cut right out of |regions|, diffs in |changes_dir| are filtered the same
+ * way unless |changes_bboxes| are given. */
+void SetRegions(const vector<PbfInput>& regions, const vector<pair<string, string>>& tags,
+                const vector<Bbox<int64_t>>& changes_bboxes, Shard* shard) {
+    shard->regions = regions;
+    for (PbfInput& region : shard->regions) {
+        region.filter.tags = tags;
+    }
+    shard->changes_filter.tags = tags;
+    shard->changes_filter.bboxes = changes_bboxes;
+    bool bounded = changes_bboxes.empty();
+    for (const PbfInput& region : regions) {
+        bounded = bounded && !region.filter.bboxes.empty();
+    }
+    if (bounded) {
+        for (const PbfInput& region : regions) {
+            shard->changes_filter.bboxes.push_back(region.filter.bboxes[0]);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    ServerOptions options;
+    vector<PbfInput> regions;
+    vector<pair<string, string>> region_tags = kFootwayTags;
+    // shard names in order of appearance, with their regions
+    vector<pair<string, vector<PbfInput>>> shard_regions;
+    string changes_dir;
+    vector<Bbox<int64_t>> changes_bboxes;
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (StartsWith(arg, "--reload_cpus=")) {
+            if (!ParseCpuList(arg + strlen("--reload_cpus="), &options.reload_cpus)) {
+                cerr << "bad CPU list: " << arg << endl;
+                return 1;
+            }
+        } else if (StartsWith(arg, "--reload_read_mbps=")) {
+            options.reload_options.max_read_bytes_per_second = atoll(arg + strlen("--reload_read_mbps=")) * 1000000;
+        } else if (StartsWith(arg, "--reload_threads=")) {
+            options.reload_options.threads = atoi(arg + strlen("--reload_threads="));
+        } else if (strcmp(arg, "--foreground_reload") == 0) {
+            options.background_reload = false;
+        } else if (strcmp(arg, "--huge_pages") == 0) {
+            OsmModel::SetHugePages(true);
+        } else if (StartsWith(arg, "--region=")) {
+            PbfInput region;
+            if (!ParsePbfInput(arg + strlen("--region="), &region)) {
+                cerr << "bad region: " << arg << endl;
+                return 1;
+            }
+            regions.push_back(region);
+        } else if (StartsWith(arg, "--shard=")) {
+            string spec = arg + strlen("--shard=");
+            size_t colon = spec.find(':');
+            PbfInput region;
+            if (colon == string::npos || colon == 0 || !ParsePbfInput(spec.substr(colon + 1), &region)) {
+                cerr << "bad shard: " << arg << endl;
+                return 1;
+            }
+            string name = spec.substr(0, colon);
+            auto it = find_if(shard_regions.begin(), shard_regions.end(), [&](const pair<string, vector<PbfInput>>& shard) {
+                return shard.first == name;
+            });
+            if (it == shard_regions.end()) {
+                shard_regions.push_back({name, {}});
+                it = shard_regions.end() - 1;
+            }
+            it->second.push_back(region);
+        } else if (StartsWith(arg, "--region_tags=")) {
+            if (!ParseTagList(arg + strlen("--region_tags="), &region_tags)) {
+                cerr << "bad tags: " << arg << endl;
+                return 1;
+            }
+        } else if (StartsWith(arg, "--changes_dir=")) {
+            changes_dir = arg + strlen("--changes_dir=");
+        } else if (StartsWith(arg, "--changes_bbox=")) {
+            double west, south, east, north;
+            if (sscanf(arg + strlen("--changes_bbox="), "%lf,%lf,%lf,%lf", &west, &south, &east, &north) != 4) {
+                cerr << "bad bbox: " << arg << endl;
+                return 1;
+            }
+            changes_bboxes.push_back({int64_t(west * 1e7), int64_t(south * 1e7), int64_t(east * 1e7), int64_t(north * 1e7)});
+        } else {
+            cerr << "usage: " << argv[0] << " [--reload_cpus=2,3|4-7] [--reload_read_mbps=N] [--reload_threads=N] [--foreground_reload] [--huge_pages]"
+                 << " [--region=REGION.osm.pbf[@WEST,SOUTH,EAST,NORTH]...|--shard=NAME:REGION.osm.pbf[@WEST,SOUTH,EAST,NORTH]...]"
+                 << " [--region_tags=highway=footway,highway=cycleway]"
+                 << " [--changes_dir=DIR [--changes_bbox=WEST,SOUTH,EAST,NORTH]...]" << endl;
+            return 1;
+        }
+    }
+    if (!regions.empty() && !shard_regions.empty()) {
+        cerr << "--region and --shard do not mix" << endl;
+        return 1;
+    }
+
+    Shards shards;
+    if (shard_regions.empty()) {
+        unique_ptr<Shard> shard(new Shard());
+        shard->name = "default";
+        shard->data_path = kMapDataPath;
+        shard->state_path = kStatePath;
+        shard->snapshot_path = kSnapshotPath;
+        shard->changes_dir = changes_dir;
+        shard->changes_filter.bboxes = changes_bboxes;
+        if (!regions.empty()) {
+            SetRegions(regions, region_tags, changes_bboxes, shard.get());
+        }
+        shards.push_back(move(shard));
+    }
+    for (const auto& shard_region : shard_regions) {
+        const string& name = shard_region.first;
+        unique_ptr<Shard> shard(new Shard());
+        shard->name = name;
+        shard->state_path = name + ".state.txt";
+        shard->snapshot_path = name + ".snapshot";
+        if (!changes_dir.empty()) {
+            shard->changes_dir = changes_dir + "/" + name;
+        }
+        SetRegions(shard_region.second, region_tags, changes_bboxes, shard.get());
+        shards.push_back(move(shard));
+    }
+    return StartServer(shards, options);
 }
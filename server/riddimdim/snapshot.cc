@@ -0,0 +1,459 @@
+#include "snapshot.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include "mapped_file.h"
+
+/* The snapshot is a local cache of this very binary, so it is written in
+ * host byte order and its layout follows the structs below. Bump the
+ * version whenever any of them changes. */
+const char kSnapshotMagic[8] = {'S', 'K', 'M', 'S', 'N', 'A', 'P', '\0'};
+const uint32_t kSnapshotVersion = 8;
+
+enum SnapshotSection {
+    kStringOffsetsSection,
+    kStringDataSection,
+    kWayIdsSection,
+    kNodeOffsetsSection,
+    kNodeIdsSection,
+    kPointOffsetsSection,
+    kPointsSection,
+    kTagOffsetsSection,
+    kTagsSection,
+    kCellsSection,
+    kCellWaysSection,
+    kBlobsSection,
+    kBlobWaysSection,
+    kMissingRefsSection,
+    kSectionCount,
+};
+
+struct SectionInfo {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t section_count;
+    int64_t state;
+    int64_t cell_size;
+    int32_t skipped_ways;
+    int32_t partial_ways;
+    uint32_t timestamp_string;
+    uint32_t reserved;
+    // see SnapshotSource
+    uint64_t source;
+    // of the last change file the data has, see OsmData
+    int64_t sequence;
+    SectionInfo sections[kSectionCount];
+};
+
+struct SnapshotCell {
+    int32_t lat_key;
+    int32_t lon_key;
+    uint32_t first_way;
+    uint32_t ways_count;
+};
+
+struct SnapshotBlob {
+    uint64_t hash;
+    int64_t min_node_id;
+    int64_t max_node_id;
+    uint32_t first_way;
+    uint32_t ways_count;
+    int32_t skipped_ways;
+    int32_t partial_ways;
+    uint32_t first_missing_ref;
+    uint32_t missing_refs_count;
+};
+
+// sections start on page boundaries, so that the arrays of the way store
+// can be served right from the file
+const uint64_t kSectionAlignment = 4096;
+
+uint64_t AlignSection(uint64_t offset) {
+    return (offset + kSectionAlignment - 1) / kSectionAlignment * kSectionAlignment;
+}
+
+/* The arrays of the way store are written as they are, next to these. The
+ * strings are those of the dictionary in ID order, followed by the
+ * timestamp. */
+struct SnapshotBuilder {
+    vector<uint32_t> string_offsets = {0};
+    string string_data;
+    vector<SnapshotCell> cells;
+    vector<uint32_t> cell_ways;
+    vector<SnapshotBlob> blobs;
+    vector<uint32_t> blob_ways;
+    vector<int64_t> missing_refs;
+
+    uint32_t AddString(const string& s) {
+        string_data += s;
+        string_offsets.push_back(uint32_t(string_data.size()));
+        return uint32_t(string_offsets.size() - 2);
+    }
+
+    void AddCell(const pair<int, int>& key, const vector<uint32_t>& cell) {
+        cells.push_back({key.first, key.second, uint32_t(cell_ways.size()), uint32_t(cell.size())});
+        cell_ways.insert(cell_ways.end(), cell.begin(), cell.end());
+    }
+
+    void AddBlob(const BlobRecord& record) {
+        blobs.push_back({record.hash, record.min_node_id, record.max_node_id, uint32_t(blob_ways.size()), uint32_t(record.ways.size()),
+                         record.skipped_ways, record.partial_ways,
+                         uint32_t(missing_refs.size()), uint32_t(record.missing_refs.size())});
+        blob_ways.insert(blob_ways.end(), record.ways.begin(), record.ways.end());
+        missing_refs.insert(missing_refs.end(), record.missing_refs.begin(), record.missing_refs.end());
+    }
+};
+
+struct SectionData {
+    const void* data;
+    uint64_t size;
+};
+
+template<class T>
+SectionData ToSection(const T& items) {
+    return {items.data(), items.size() * sizeof(items[0])};
+}
+
+uint64_t SnapshotSource(const string& data_path) {
+    size_t slash = data_path.rfind('/');
+    string name = "file:" + (slash == string::npos ? data_path : data_path.substr(slash + 1));
+    return HashBytes(reinterpret_cast<const uint8_t*>(name.data()), name.size());
+}
+
+uint64_t SnapshotSource(const vector<PbfInput>& inputs) {
+    stringstream description;
+    for (const PbfInput& input : inputs) {
+        description << "region:" << input.path << "@";
+        for (const Bbox<int64_t>& bbox : input.filter.bboxes) {
+            description << bbox.ToString() << ";";
+        }
+        for (const auto& tag : input.filter.tags) {
+            description << tag.first << "=" << tag.second << ",";
+        }
+        description << "\n";
+    }
+    string s = description.str();
+    return HashBytes(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+}
+
+bool WriteSnapshot(const OsmData& data, const string& snapshot_path, uint64_t source) {
+    auto start_time = chrono::steady_clock::now();
+    SnapshotBuilder builder;
+    for (size_t i = 0; i < data.strings.Size(); ++i) {
+        builder.AddString(*data.strings.Get(uint32_t(i)));
+    }
+    for (const auto& cell : data.grid.GetCells()) {
+        builder.AddCell(cell.first, cell.second);
+    }
+    for (const BlobRecord& record : data.blobs) {
+        builder.AddBlob(record);
+    }
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.section_count = kSectionCount;
+    header.state = data.state;
+    header.source = source;
+    header.sequence = data.sequence;
+    header.cell_size = data.grid.GetCellSize();
+    header.skipped_ways = data.skipped_ways;
+    header.partial_ways = data.partial_ways;
+    header.timestamp_string = builder.AddString(data.timestamp);
+
+    SectionData sections[kSectionCount];
+    sections[kStringOffsetsSection] = ToSection(builder.string_offsets);
+    sections[kStringDataSection] = {builder.string_data.data(), builder.string_data.size()};
+    const OsmModel::WayStore& ways = data.grid.GetWays();
+    sections[kWayIdsSection] = ToSection(ways.GetIds());
+    sections[kNodeOffsetsSection] = ToSection(ways.GetNodeOffsets());
+    sections[kNodeIdsSection] = ToSection(ways.GetAllNodeIds());
+    sections[kPointOffsetsSection] = ToSection(ways.GetPointOffsets());
+    sections[kPointsSection] = ToSection(ways.GetAllPoints());
+    sections[kTagOffsetsSection] = ToSection(ways.GetTagOffsets());
+    sections[kTagsSection] = ToSection(ways.GetAllTags());
+    sections[kCellsSection] = ToSection(builder.cells);
+    sections[kCellWaysSection] = ToSection(builder.cell_ways);
+    sections[kBlobsSection] = ToSection(builder.blobs);
+    sections[kBlobWaysSection] = ToSection(builder.blob_ways);
+    sections[kMissingRefsSection] = ToSection(builder.missing_refs);
+    uint64_t offset = AlignSection(sizeof(header));
+    for (int i = 0; i < kSectionCount; ++i) {
+        header.sections[i] = {offset, sections[i].size};
+        offset = AlignSection(offset + sections[i].size);
+    }
+
+    // write aside and rename, so that a concurrent start never sees half a file
+    string tmp_path = snapshot_path + ".tmp";
+    {
+        ofstream out(tmp_path, ios::binary | ios::trunc);
+        if (!out) {
+            cerr << "failed to open " << tmp_path << " for writing" << endl;
+            return false;
+        }
+        const char padding[kSectionAlignment] = {};
+        out.write((const char*) &header, sizeof(header));
+        uint64_t written = sizeof(header);
+        for (int i = 0; i < kSectionCount; ++i) {
+            out.write(padding, header.sections[i].offset - written);
+            out.write((const char*) sections[i].data, sections[i].size);
+            written = header.sections[i].offset + sections[i].size;
+        }
+        if (!out) {
+            cerr << "failed to write " << tmp_path << endl;
+            return false;
+        }
+    }
+    if (rename(tmp_path.c_str(), snapshot_path.c_str()) != 0) {
+        cerr << "failed to rename " << tmp_path << " to " << snapshot_path << endl;
+        return false;
+    }
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "Snapshot of state " << data.state << " is written to " << snapshot_path
+         << " in " << elapsed.count() << " ms" << endl;
+    return true;
+}
+
+template<class T>
+bool GetSection(const MappedFile& file, const SnapshotHeader& header, SnapshotSection section,
+                const T** items, size_t* count) {
+    const SectionInfo& info = header.sections[section];
+    if (info.offset % alignof(T) != 0 || info.size % sizeof(T) != 0 ||
+            info.offset > file.Size() || info.size > file.Size() - info.offset) {
+        return false;
+    }
+    *items = reinterpret_cast<const T*>(file.Data() + info.offset);
+    *count = info.size / sizeof(T);
+    return true;
+}
+
+/* An array of the way store served right from the snapshot file, if the
+ * section lies on a page boundary of this host, or else a copy of it. */
+template<class T>
+OsmModel::MappedArray<T> ServeSection(const MappedFile& file, const SnapshotHeader& header, SnapshotSection section,
+                                      const T* items, size_t count) {
+    OsmModel::MappedArray<T> result;
+    uint64_t offset = header.sections[section].offset;
+    if (offset % uint64_t(sysconf(_SC_PAGESIZE)) != 0 || !result.MapFile(file.Descriptor(), offset, count)) {
+        result = OsmModel::MappedArray<T>(items, count);
+    }
+    return result;
+}
+
+OsmDataHolder ReadSnapshot(const string& snapshot_path, int64_t expected_state, uint64_t expected_source) {
+    auto start_time = chrono::steady_clock::now();
+    MappedFile file(snapshot_path);
+    if (!file.IsValid()) {
+        cout << "No snapshot at " << snapshot_path << endl;
+        return {};
+    }
+    SnapshotHeader header;
+    if (file.Size() < sizeof(header)) {
+        cerr << "snapshot " << snapshot_path << " is truncated" << endl;
+        return {};
+    }
+    memcpy(&header, file.Data(), sizeof(header));
+    if (memcmp(header.magic, kSnapshotMagic, sizeof(header.magic)) != 0 ||
+            header.version != kSnapshotVersion || header.section_count != kSectionCount) {
+        cout << "Snapshot " << snapshot_path << " has another format, ignoring it" << endl;
+        return {};
+    }
+    if (header.state != expected_state) {
+        cout << "Snapshot " << snapshot_path << " is of state " << header.state
+             << ", but state " << expected_state << " is expected" << endl;
+        return {};
+    }
+    if (header.source != expected_source) {
+        cout << "Snapshot " << snapshot_path << " is built from other files or with another filter, ignoring it" << endl;
+        return {};
+    }
+
+    const uint32_t* string_offsets = nullptr;
+    const char* string_data = nullptr;
+    const int64_t* way_ids = nullptr;
+    const uint32_t* node_offsets = nullptr;
+    const int64_t* node_ids = nullptr;
+    const uint32_t* point_offsets = nullptr;
+    const int16_t* points = nullptr;
+    const uint32_t* tag_offsets = nullptr;
+    const OsmModel::Tag* tags = nullptr;
+    const SnapshotCell* cells = nullptr;
+    const uint32_t* cell_ways = nullptr;
+    const SnapshotBlob* blobs = nullptr;
+    const uint32_t* blob_ways = nullptr;
+    const int64_t* missing_refs = nullptr;
+    size_t string_offsets_nr = 0, string_data_size = 0, ways_nr = 0, node_offsets_nr = 0, node_ids_nr = 0, point_offsets_nr = 0, points_nr = 0;
+    size_t tag_offsets_nr = 0, tags_nr = 0, cells_nr = 0, cell_ways_nr = 0, blobs_nr = 0, blob_ways_nr = 0;
+    size_t missing_refs_nr = 0;
+    if (!GetSection(file, header, kStringOffsetsSection, &string_offsets, &string_offsets_nr) ||
+            !GetSection(file, header, kStringDataSection, &string_data, &string_data_size) ||
+            !GetSection(file, header, kWayIdsSection, &way_ids, &ways_nr) ||
+            !GetSection(file, header, kNodeOffsetsSection, &node_offsets, &node_offsets_nr) ||
+            !GetSection(file, header, kNodeIdsSection, &node_ids, &node_ids_nr) ||
+            !GetSection(file, header, kPointOffsetsSection, &point_offsets, &point_offsets_nr) ||
+            !GetSection(file, header, kPointsSection, &points, &points_nr) ||
+            !GetSection(file, header, kTagOffsetsSection, &tag_offsets, &tag_offsets_nr) ||
+            !GetSection(file, header, kTagsSection, &tags, &tags_nr) ||
+            !GetSection(file, header, kCellsSection, &cells, &cells_nr) ||
+            !GetSection(file, header, kCellWaysSection, &cell_ways, &cell_ways_nr) ||
+            !GetSection(file, header, kBlobsSection, &blobs, &blobs_nr) ||
+            !GetSection(file, header, kBlobWaysSection, &blob_ways, &blob_ways_nr) ||
+            !GetSection(file, header, kMissingRefsSection, &missing_refs, &missing_refs_nr) ||
+            string_offsets_nr == 0) {
+        cerr << "snapshot " << snapshot_path << " has broken sections" << endl;
+        return {};
+    }
+
+    OsmDataHolder osm_data = make_shared<OsmData>(header.cell_size);
+    osm_data->state = header.state;
+    osm_data->sequence = header.sequence;
+    osm_data->skipped_ways = header.skipped_ways;
+    osm_data->partial_ways = header.partial_ways;
+    osm_data->complete = true;
+
+    // the dictionary first, the timestamp is the last string
+    size_t strings_nr = string_offsets_nr - 1;
+    if (header.timestamp_string + 1 != strings_nr) {
+        cerr << "snapshot " << snapshot_path << " has a broken timestamp" << endl;
+        return {};
+    }
+    for (size_t i = 0; i < strings_nr; ++i) {
+        uint32_t begin = string_offsets[i];
+        uint32_t end = string_offsets[i + 1];
+        if (begin > end || end > string_data_size) {
+            cerr << "snapshot " << snapshot_path << " has a broken string #" << i << endl;
+            return {};
+        }
+        string s(string_data + begin, end - begin);
+        if (i == header.timestamp_string) {
+            osm_data->timestamp = s;
+        } else if (osm_data->strings.Intern(s) != i) {
+            cerr << "snapshot " << snapshot_path << " has a repeated string #" << i << endl;
+            return {};
+        }
+    }
+
+    // the way store is not copied, its pages are read in as queries use them
+    OsmModel::WayStore ways;
+    if (!ways.Assign(ServeSection(file, header, kWayIdsSection, way_ids, ways_nr),
+                     ServeSection(file, header, kNodeOffsetsSection, node_offsets, node_offsets_nr),
+                     ServeSection(file, header, kNodeIdsSection, node_ids, node_ids_nr),
+                     ServeSection(file, header, kPointOffsetsSection, point_offsets, point_offsets_nr),
+                     ServeSection(file, header, kPointsSection, points, points_nr),
+                     ServeSection(file, header, kTagOffsetsSection, tag_offsets, tag_offsets_nr),
+                     ServeSection(file, header, kTagsSection, tags, tags_nr))) {
+        cerr << "snapshot " << snapshot_path << " has broken ways" << endl;
+        return {};
+    }
+    for (const OsmModel::Tag& tag : ways.GetAllTags()) {
+        if (tag.key >= header.timestamp_string || tag.value >= header.timestamp_string) {
+            cerr << "snapshot " << snapshot_path << " has a broken tag" << endl;
+            return {};
+        }
+    }
+    osm_data->grid.RestoreWays(move(ways));
+
+    for (size_t i = 0; i < cells_nr; ++i) {
+        const SnapshotCell& cell = cells[i];
+        if (uint64_t(cell.first_way) + cell.ways_count > cell_ways_nr) {
+            cerr << "snapshot " << snapshot_path << " has a broken cell" << endl;
+            return {};
+        }
+        Grid<int64_t, int>::Cell cell_way_indices(cell_ways + cell.first_way, cell_ways + cell.first_way + cell.ways_count);
+        for (uint32_t way : cell_way_indices) {
+            if (way >= ways_nr) {
+                cerr << "snapshot " << snapshot_path << " has a broken cell" << endl;
+                return {};
+            }
+        }
+        osm_data->grid.RestoreCell({cell.lat_key, cell.lon_key}, move(cell_way_indices));
+    }
+
+    osm_data->blobs.reserve(blobs_nr);
+    for (size_t i = 0; i < blobs_nr; ++i) {
+        const SnapshotBlob& blob = blobs[i];
+        if (uint64_t(blob.first_way) + blob.ways_count > blob_ways_nr ||
+                uint64_t(blob.first_missing_ref) + blob.missing_refs_count > missing_refs_nr) {
+            cerr << "snapshot " << snapshot_path << " has a broken blob record" << endl;
+            return {};
+        }
+        BlobRecord record;
+        record.hash = blob.hash;
+        record.min_node_id = blob.min_node_id;
+        record.max_node_id = blob.max_node_id;
+        record.ways.assign(blob_ways + blob.first_way, blob_ways + blob.first_way + blob.ways_count);
+        for (uint32_t way : record.ways) {
+            if (way >= ways_nr) {
+                cerr << "snapshot " << snapshot_path << " has a broken blob record" << endl;
+                return {};
+            }
+        }
+        record.skipped_ways = blob.skipped_ways;
+        record.partial_ways = blob.partial_ways;
+        record.missing_refs.assign(missing_refs + blob.first_missing_ref, missing_refs + blob.first_missing_ref + blob.missing_refs_count);
+        osm_data->blobs.push_back(move(record));
+    }
+
+    auto elapsed = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start_time);
+    cout << "State " << osm_data->state << " is loaded from snapshot " << snapshot_path << ":" << endl;
+    cout << "  Total number of strings: " << osm_data->strings.Size() << endl;
+    cout << "  Total number of way nodes: " << node_ids_nr << endl;
+    cout << "  Total number of ways: " << osm_data->grid.CountWays() << endl;
+    cout << "  Loaded in " << elapsed.count() << " ms" << endl;
+    return osm_data;
+}
+
+void WriteSnapshotIfComplete(const OsmData& osm_data, const string& snapshot_path, uint64_t source) {
+    if (osm_data.complete) {
+        WriteSnapshot(osm_data, snapshot_path, source);
+    } else {
+        cerr << "data of state " << osm_data.state << " is incomplete, no snapshot is written" << endl;
+    }
+}
+
+OsmDataHolder OpenData(const string& data_path, const string& state_path, const string& snapshot_path, const LoadOptions& options, const OsmData* previous) {
+    uint64_t source = SnapshotSource(data_path);
+    int64_t state = ReadState(state_path);
+    if (!state) {
+        return nullptr;
+    }
+    OsmDataHolder osm_data = ReadSnapshot(snapshot_path, state, source);
+    if (osm_data) {
+        return osm_data;
+    }
+    if (previous && !previous->blobs.empty()) {
+        osm_data = UpdatePbfData(*previous, data_path, state_path, options);
+    } else {
+        osm_data = OpenPbfData2(data_path, state_path, options);
+    }
+    WriteSnapshotIfComplete(*osm_data, snapshot_path, source);
+    return osm_data;
+}
+
+OsmDataHolder OpenData(const vector<PbfInput>& inputs, const string& state_path, const string& snapshot_path, const LoadOptions& options) {
+    uint64_t source = SnapshotSource(inputs);
+    int64_t state = ReadState(state_path);
+    if (!state) {
+        return nullptr;
+    }
+    OsmDataHolder osm_data = ReadSnapshot(snapshot_path, state, source);
+    if (osm_data) {
+        return osm_data;
+    }
+    osm_data = OpenPbfInputs(inputs, state_path, options);
+    WriteSnapshotIfComplete(*osm_data, snapshot_path, source);
+    return osm_data;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "loader.h"
+
+using namespace std;
+
+/* A snapshot is a flat binary dump of a loaded OsmData: strings, the arrays
+ * of the way store, grid cells and blob records as offset-addressed sections. It records
+ * the state and the source it was built from, so that it can be reused as
+ * long as neither changes. The arrays of the way store are served right
+ * from the file instead of being copied. */
+
+/* Identifies what the data is loaded from: the name of the PBF file, or the
+ * paths, bboxes and tag filters of all the regional inputs. */
+uint64_t SnapshotSource(const string& data_path);
+uint64_t SnapshotSource(const vector<PbfInput>& inputs);
+
+bool WriteSnapshot(const OsmData& data, const string& snapshot_path, uint64_t source);
+
+/* Returns null if the snapshot is missing, broken, of another format
+ * version or was not built from |expected_state| and |expected_source|. */
+OsmDataHolder ReadSnapshot(const string& snapshot_path, int64_t expected_state, uint64_t expected_source);
+
+/* Loads the snapshot if it matches the current state, otherwise parses the
+ * PBF file and writes a fresh snapshot for the next start. Given the data
+ * that is currently in use, only the blobs that changed since are parsed.
+ * Gives null if there is no valid state file. */
+OsmDataHolder OpenData(const string& data_path, const string& state_path, const string& snapshot_path,
+                       const LoadOptions& options = LoadOptions(), const OsmData* previous = nullptr);
+
+/* Same for data cut right out of regional files, see OpenPbfInputs. */
+OsmDataHolder OpenData(const vector<PbfInput>& inputs, const string& state_path, const string& snapshot_path,
+                       const LoadOptions& options = LoadOptions());
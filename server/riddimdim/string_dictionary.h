@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "tag_keys.h"
+
+using namespace std;
+
+/* Keeps every distinct string once and gives it a dense 32-bit ID, which is
+ * what tags refer to. The known keys of tag_keys.h always come first. Copies
+ * share the strings themselves. */
+class StringDictionary {
+    struct ContentHash {
+        size_t operator()(const string* s) const {
+            return hash<string>()(*s);
+        }
+    };
+
+    struct ContentEqual {
+        bool operator()(const string* a, const string* b) const {
+            return *a == *b;
+        }
+    };
+
+    vector<shared_ptr<string>> strings_;
+    unordered_map<const string*, uint32_t, ContentHash, ContentEqual> ids_;
+
+public:
+    StringDictionary() {
+        for (const char* name : kTagKeyNames) {
+            Intern(name);
+        }
+    }
+
+    uint32_t Intern(const string& s) {
+        auto it = ids_.find(&s);
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        uint32_t id = uint32_t(strings_.size());
+        strings_.push_back(make_shared<string>(s));
+        ids_.emplace(strings_.back().get(), id);
+        return id;
+    }
+
+    /* Same, but shares |s| if it is new, e.g. a string of another
+     * dictionary. */
+    uint32_t Intern(const shared_ptr<string>& s) {
+        auto it = ids_.find(s.get());
+        if (it != ids_.end()) {
+            return it->second;
+        }
+        uint32_t id = uint32_t(strings_.size());
+        strings_.push_back(s);
+        ids_.emplace(s.get(), id);
+        return id;
+    }
+
+    const shared_ptr<string>& Get(uint32_t id) const {
+        return strings_[id];
+    }
+
+    size_t Size() const {
+        return strings_.size();
+    }
+};
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+
+using namespace std;
+
+/* Tag keys the client uses. Every StringDictionary interns them first, so
+ * in any data their string IDs are these values, and a tag is told to have
+ * one of them by its key ID alone. */
+enum TagKey : uint32_t {
+    kHighwayKey,
+    kSurfaceKey,
+    kSmoothnessKey,
+    kInclineKey,
+    kLitKey,
+    kTagKeyCount,
+};
+
+constexpr const char* kTagKeyNames[kTagKeyCount] = {"highway", "surface", "smoothness", "incline", "lit"};
+
+constexpr bool IsKnownKey(uint32_t key) {
+    return key < kTagKeyCount;
+}
@@ -0,0 +1,68 @@
+#include "thread_priority.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+bool LowerThreadPriority() {
+    sched_param param;
+    memset(&param, 0, sizeof(param));
+    // pid 0 is the calling thread for the sched_* calls on Linux
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == 0) {
+        return true;
+    }
+    cerr << "failed to switch to SCHED_IDLE: " << strerror(errno) << ", lowering nice value" << endl;
+    pid_t tid = pid_t(syscall(SYS_gettid));
+    if (setpriority(PRIO_PROCESS, id_t(tid), 19) != 0) {
+        cerr << "failed to lower nice value: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool SetThreadAffinity(const vector<int>& cpus) {
+    if (cpus.empty()) {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+        cerr << "failed to set CPU affinity: " << strerror(errno) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool ParseCpuList(const string& text, vector<int>* cpus) {
+    cpus->clear();
+    stringstream stream(text);
+    string range;
+    while (getline(stream, range, ',')) {
+        int first, last;
+        char dash;
+        stringstream range_stream(range);
+        if (!(range_stream >> first)) {
+            return false;
+        }
+        last = first;
+        if (range_stream >> dash && (dash != '-' || !(range_stream >> last))) {
+            return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; ++cpu) {
+            cpus->push_back(cpu);
+        }
+    }
+    return !cpus->empty();
+}
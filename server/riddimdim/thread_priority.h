@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/* Both calls affect only the calling thread, but threads it starts later
+ * inherit the setting, so a loader run from a background thread keeps all
+ * of its workers in the background too. */
+
+/* Switches to SCHED_IDLE, so that the thread runs only on otherwise idle
+ * CPUs, or to the lowest nice value where that is not available. */
+bool LowerThreadPriority();
+
+/* Pins the thread to |cpus|; an empty list leaves the affinity as is. */
+bool SetThreadAffinity(const vector<int>& cpus);
+
+/* Parses a CPU list like "2,3" or "4-7". */
+bool ParseCpuList(const string& text, vector<int>* cpus);